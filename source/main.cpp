@@ -1,6 +1,7 @@
 #include <nds.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <math.h>
 #include <nf_lib.h>
@@ -8,6 +9,7 @@
 #include "nds/ndstypes.h"
 #include <maxmod9.h>
 #include <string.h>
+#include <new>
 
 #define SCREEN_WIDTH 256
 #define SCREEN_HEIGHT 192
@@ -16,11 +18,101 @@
 #define TABLE_MAX (SCREEN_HEIGHT - 2*SCREEN_PADDING + 1)
 
 #define PRINT_WIDTH 32
+#define PRINT_HEIGHT 24
 
 #define SAMPLING_RATE 10000
 #define BUFFER_SIZE 1200
 
-#define DEPOP_FRAMES 50
+#define PLAYBACK_BITS 11
+#define PLAYBACK_LENGTH (1 << PLAYBACK_BITS) // length of the tables the Wavetable synth actually plays
+#define PHASE_SHIFT (32 - PLAYBACK_BITS) // the playback index is the top bits of a 32 bit phase
+#define WAVETABLE_FRAMES 64 // how many steps of the transition the frame store holds
+#define WAVETABLE_FRAME_BITS 8 // 8 or 16. 8 halves the frame store and still fits every drawable value
+#define FRAMES_PER_IDLE 4 // frames built per main loop while the frame store catches up with the editors
+#define SPECTRAL_BITS 8
+#define SPECTRAL_LENGTH (1 << SPECTRAL_BITS) // points in the FFTs the spectral morph uses
+#define SPECTRAL_SHIFT 14 // how far wave samples are scaled up before the FFT, for precision
+#define BLEP_BITS 6
+#define BLEP_LENGTH (1 << BLEP_BITS) // steps in the band limited step correction table
+#define SYNC_RATIO_MAX 700 // hard sync goes up to 1 + SYNC_RATIO_MAX / 100 times the key's pitch
+#define UNISON_MAX 8 // copies of each voice, counting the voice itself
+#define UNISON_MAX_DETUNE 50 // in cents, for the outermost copies
+#define EXPORT_LOOP_CYCLES 8 // exported wavs restart their phase this often so the loop points line up
+
+#define SINE_BITS 10
+#define SINE_LENGTH (1 << SINE_BITS) // entries in one cycle of the sine table
+#define ANGLE_BITS 16 // angles go from 0 to 1 << ANGLE_BITS for a whole circle
+#define SINE_INTERPOLATE 1 // 1 to interpolate between sine table entries, 0 to just look them up
+#define FM_INDEX_SHIFT 2 // a full scale modulator swings its carrier by 1 << (FM_INDEX_SHIFT - 1) cycles either way
+#define FM_OPERATORS 8 // operators per FM voice. the editors hold up to 8 values
+#define FM_ROUTE_OUTPUT FM_OPERATORS // routing value for an operator that goes to the output
+#define FM_ROUTE_OFF (FM_OPERATORS + 1) // routing value for an operator that's switched off
+#define FM_PRESETS 6 // algorithm presets, not counting the routing editor
+#define FM_FEEDBACK_SHIFT 10 // a feedback slider value of 1 << FM_FEEDBACK_SHIFT would feed back full scale
+#define FM_MAX_OVERSAMPLING 2 // log2 of the most times faster than its output the FM synth can render
+#define HALFBAND_PAIRS 7 // coefficient pairs either side of the middle of the decimation filter
+#define HALFBAND_HISTORY 32 // power of two, more than 4 * HALFBAND_PAIRS samples
+
+#define DELAY_POOL_BITS 15
+#define DELAY_POOL_LENGTH (1 << DELAY_POOL_BITS) // samples in the pool the string synths take their delay lines from
+#define DELAY_BLOCK_BITS 6 // delay lines are at least 1 << DELAY_BLOCK_BITS samples
+#define DELAY_MAX_BITS 11 // and at most 1 << DELAY_MAX_BITS, which fits the lowest key at 20000 Hz
+
+#define OVERLAY_FRAME_BYTES ((WAVETABLE_FRAMES + 13) * PLAYBACK_LENGTH * (WAVETABLE_FRAME_BITS / 8)) // the wavetable synth's frame store and cycle caches
+#define OVERLAY_DELAY_BYTES (DELAY_POOL_LENGTH * 2) // the string synths' delay pool
+#define OVERLAY_SIZE ((OVERLAY_FRAME_BYTES > OVERLAY_DELAY_BYTES ? OVERLAY_FRAME_BYTES : OVERLAY_DELAY_BYTES) + 16384) // bytes. whichever of those is bigger, plus room for voices
+#define OVERLAY_ALIGN 32 // everything in the overlay starts on a cache line
+
+#define SURFACE_DIRTY_RECTS 16 // rectangles waiting to be copied to the screen before new ones get merged in
+#define SURFACE_COPY_BUDGET (SCREEN_WIDTH * 64) // most pixels copied to the screen per frame. about what fits in VBlank
+
+#define SCOPE_RING_BITS 9
+#define SCOPE_RING (1 << SCOPE_RING_BITS) // points the oscilloscope keeps. twice what fits on the screen, to look back for a trigger
+#define SCOPE_STRIDE 2 // the oscilloscope keeps one sample in this many
+#define SCOPE_COLOR 2 // palette entry of the trace. the console doesn't use it
+#define SCOPE_PIXEL_BUDGET (SCREEN_WIDTH * 16) // most pixels the oscilloscope looks at per frame. a busy trace takes a few frames to sweep across
+
+#define MIX_BLOCK 128 // how many samples synths render at a time
+
+#define CONTROL_SHIFT 5
+#define CONTROL_PERIOD (1 << CONTROL_SHIFT) // samples between control rate ticks
+
+#define MOD_SHIFT 12
+#define MOD_ONE (1 << MOD_SHIFT) // full scale of a modulation source
+#define MOD_AMOUNT_MAX (TABLE_LENGTH - 1) // full scale of a modulation editor value
+#define ENVELOPE_EXTRA_BITS 12
+
+// layout of the modulation editor values
+#define MOD_LFO_RATE 0
+#define MOD_LFO_TO_POSITION 1
+#define MOD_ENVELOPE_DECAY 2
+#define MOD_ENVELOPE_TO_FM_AMP 3
+
+// layout of the amplitude envelope editor values
+#define AMP_ATTACK 0
+#define AMP_DECAY 1
+#define AMP_SUSTAIN 2
+#define AMP_RELEASE 3
+#define AMP_MS_PER_STEP 16 // how many milliseconds one step of an envelope time slider is worth
+
+#define BENCHMARK_BLOCKS 64
+#define BENCHMARK_SPECTRUM_BITS 8 // points in the FFT the benchmark measures aliasing with
+#define BENCHMARK_SPECTRUM_BIN 5 // the bin the test note's fundamental lands in. odd, so no alias lands on a harmonic
+#define BENCHMARK_SETTLE_BLOCKS 8 // blocks the test note plays before it's measured
+
+#define CLOCK_TIMER 2 // uses timers 2 and 3. maxmod has timer 0
+
+#define EXPORT_BUFFER_SIZE 4096 // bytes per fwrite when exporting. a whole number of sectors
+
+#define CARD_MODEL 0 // 1 to time exports against CardModel instead of writing them to the SD card
+#define CARD_OPEN_US 3000 // CardModel: opening a file, before the directory is searched
+#define CARD_ENTRY_US 60 // for each file already in the directory, which is searched from the start
+#define CARD_WRITE_US 1500 // for each write that reaches the card, however small
+#define CARD_KB_PER_SECOND 1200 // how fast the card takes the bytes of a write
+#define CARD_CLUSTER_BYTES 32768 // each time a file grows into another cluster of this many bytes,
+#define CARD_CLUSTER_US 2000 // the FAT is searched for a free one and updated
+#define CARD_CLOSE_US 4000 // closing a file writes its directory entry and the FAT back
+#define SFZ_TEXT_SIZE (128 * 96) // room for the <global> header and 128 <region> lines
 
 class MidiInfo {
 public:
@@ -66,7 +158,20 @@ public:
  * and do your own thing. I like to use "phaseFramesElapsed" as a counter telling me how many frames
  * have passed. I use it pretty often when calculating phase, hence the name. If you need a general
  * "totalFramesElapsed" field, you can add one.  
+ *
+ * "envelope" belongs to the shared amplitude envelope (see the AmpEnvelope class). A key keeps
+ * sounding through its release after "playing" goes false, so synths should ask
+ * ampEnvelope.sounding() rather than checking "playing" themselves.
  */
+struct EnvelopeState {
+    int stage;
+    int level; // MOD_ONE << ENVELOPE_EXTRA_BITS is full scale
+    int gain; // what the samples are multiplied by, out of 1 << 15. ramps to level between ticks
+    int step; // added to gain every sample
+    int framesLeft; // until the next tick
+    bool gate; // has the envelope seen the key go down (and not up yet)?
+};
+
 struct SoundInfo {
     int key; // which key does this sound info go to?
 	bool playing; // is the note currently playing?
@@ -74,14 +179,244 @@ struct SoundInfo {
     bool stopping;
     int phaseFramesElapsed;
     int freq;
-    int depopFramesElapsed;
-    int lastSampleOutputted;
+    struct EnvelopeState envelope;
 };
 
 struct SoundInfo sounds[13];
 
+/**
+ * goes up every time an editor changes a value. synths that work something out from
+ * the editor values (like resampled tables) compare it against the revision they last
+ * saw to know when to do it again
+ */
+int patchRevision = 0;
+
 PrintConsole *pc;
 
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The text layer
+ * Text on the top screen goes through here instead of printf. printf runs everything
+ * through stdio's formatting, and consoleClear rewrites the whole screen, which was most
+ * of the cost of pressing L or R. The text layer keeps a copy of the console's cells.
+ * print lays text out into the copy the way the console would: newlines start a line,
+ * and long lines wrap at PRINT_WIDTH. present writes only the cells that differ from
+ * what's on the screen into the console's map. Switching editors lays out at most a
+ * screen of cells and writes only the ones that changed, however long the description.
+ *
+ * Laying text out is just a copy, so the laid out cells aren't kept per description.
+ * There's nothing to save by caching them.
+ */
+class TextLayer {
+public:
+    TextLayer() : _x{0}, _y{0}, _stale{true} {
+        clear();
+    }
+
+    void clear() {
+        clearRows(0, PRINT_HEIGHT);
+        _x = 0;
+        _y = 0;
+    }
+
+    void clearRows(int first, int count) {
+        for (int y = first; y < first + count; y++)
+            for (int x = 0; x < PRINT_WIDTH; x++)
+                _chars[y][x] = ' ';
+    }
+
+    void moveTo(int x, int y) {
+        _x = x;
+        _y = y;
+    }
+
+    /**
+     * writes text at the cursor and moves the cursor past it. anything below the last
+     * row is dropped rather than scrolled
+     */
+    void print(const char *text) {
+        for (; *text; text++) {
+            if (*text == '\n') {
+                _x = 0;
+                _y++;
+                continue;
+            }
+            if (_x >= PRINT_WIDTH) {
+                _x = 0;
+                _y++;
+            }
+            if (_y >= PRINT_HEIGHT)
+                return;
+            _chars[_y][_x++] = *text;
+        }
+    }
+
+    /**
+     * print with printf style formatting, for the few places that need numbers
+     */
+    void format(const char *format, ...) {
+        char line[PRINT_WIDTH * PRINT_HEIGHT + 1];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        print(line);
+    }
+
+    /**
+     * puts what's changed on the screen. the first time, everything is written, since
+     * printf might have been there before
+     */
+    void present() {
+        u16 *map = pc->fontBgMap;
+        for (int y = 0; y < PRINT_HEIGHT; y++) {
+            for (int x = 0; x < PRINT_WIDTH; x++) {
+                if (_chars[y][x] != _shown[y][x] || _stale) {
+                    _shown[y][x] = _chars[y][x];
+                    map[y * PRINT_WIDTH + x] = pc->fontCurPal | (u16)(_chars[y][x] + pc->fontCharOffset - pc->font.asciiOffset);
+                }
+            }
+        }
+        _stale = false;
+    }
+
+private:
+    char _chars[PRINT_HEIGHT][PRINT_WIDTH]; // what the screen should say
+    char _shown[PRINT_HEIGHT][PRINT_WIDTH]; // what it says
+    int _x;
+    int _y;
+    bool _stale; // the screen hasn't been written yet, so _shown means nothing
+};
+
+TextLayer text;
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The surface
+ * Editors never draw on the bottom screen itself. They draw on a copy of it in main RAM,
+ * in rectangles of one colour, and each rectangle they draw is remembered as dirty. Once
+ * per frame, right after VBlank, present copies the dirty rectangles onto the screen
+ * with DMA, up to SURFACE_COPY_BUDGET pixels of them. Anything past the budget waits for
+ * the next frame. That way the screen never changes halfway through being drawn, and
+ * however much someone scribbles, the UI costs the main loop the same bounded time, which
+ * leaves it to get back to mmStreamUpdate.
+ *
+ * Editors still only repaint the rectangles that changed. Each one remembers what it
+ * last drew, so a touch costs a few spans rather than the whole editor.
+ */
+class Surface {
+public:
+    static void fillRect(int x, int y, int width, int height, u16 color) {
+        if (width <= 0 || height <= 0)
+            return;
+        for (int j = y; j < y + height; j++)
+            fillSpan(&_pixels[SCREEN_WIDTH * j + x], width, color);
+        markDirty(x, y, width, height);
+    }
+
+    static void fillColumn(int x, int y, int height, u16 color) {
+        for (int j = y; j < y + height; j++)
+            _pixels[SCREEN_WIDTH * j + x] = color;
+        markDirty(x, y, 1, height);
+    }
+
+    static void setPixel(int x, int y, u16 color) {
+        _pixels[SCREEN_WIDTH * y + x] = color;
+        markDirty(x, y, 1, 1);
+    }
+
+    /**
+     * copies up to SURFACE_COPY_BUDGET pixels of what's changed onto the screen. call it
+     * right after VBlank
+     */
+    static void present() {
+        int budget = SURFACE_COPY_BUDGET;
+        while (_numDirty > 0 && budget > 0) {
+            struct rect *dirty = &_dirty[_numDirty - 1];
+            int rows = budget / dirty->width;
+            if (rows == 0)
+                break;
+            if (rows > dirty->height)
+                rows = dirty->height;
+            u16 *first = &_pixels[SCREEN_WIDTH * dirty->y];
+            DC_FlushRange(first, SCREEN_WIDTH * rows * 2);
+            for (int j = dirty->y; j < dirty->y + rows; j++) {
+                int offset = SCREEN_WIDTH * j + dirty->x;
+                dmaCopyHalfWords(3, &_pixels[offset], &VRAM_A[offset], dirty->width * 2);
+            }
+            budget -= rows * dirty->width;
+            dirty->y += rows;
+            dirty->height -= rows;
+            if (dirty->height == 0)
+                _numDirty--;
+        }
+    }
+
+private:
+    struct rect {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    static u16 _pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+    static struct rect _dirty[SURFACE_DIRTY_RECTS];
+    static int _numDirty;
+
+    /**
+     * fills with the CPU a word (two pixels) at a time. DMA would go around the data
+     * cache, which still has the CPU's own writes to the copy in it
+     */
+    static void fillSpan(u16 *pixels, int count, u16 color) {
+        if (((uintptr_t)pixels & 2) && count > 0) {
+            *pixels++ = color;
+            count--;
+        }
+        u32 pair = color | (color << 16);
+        u32 *words = (u32 *)pixels;
+        for (; count >= 2; count -= 2)
+            *words++ = pair;
+        if (count > 0)
+            *(u16 *)words = color;
+    }
+
+    static int area(const struct rect &r) { return r.width * r.height; }
+
+    static struct rect merged(const struct rect &a, const struct rect &b) {
+        struct rect r;
+        r.x = a.x < b.x ? a.x : b.x;
+        r.y = a.y < b.y ? a.y : b.y;
+        r.width = (a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width) - r.x;
+        r.height = (a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height) - r.y;
+        return r;
+    }
+
+    /**
+     * adds a rectangle to the ones waiting to be copied. it's merged into whichever one it
+     * would add the fewest extra pixels to, if that's less than a row of the screen or
+     * there's no room for it on its own
+     */
+    static void markDirty(int x, int y, int width, int height) {
+        struct rect added = {x, y, width, height};
+        int best = -1;
+        int bestGrowth = 0;
+        for (int i = 0; i < _numDirty; i++) {
+            int growth = area(merged(_dirty[i], added)) - area(_dirty[i]) - area(added);
+            if (best < 0 || growth < bestGrowth) {
+                best = i;
+                bestGrowth = growth;
+            }
+        }
+        if (best >= 0 && (bestGrowth <= SCREEN_WIDTH || _numDirty == SURFACE_DIRTY_RECTS))
+            _dirty[best] = merged(_dirty[best], added);
+        else
+            _dirty[_numDirty++] = added;
+    }
+};
+
+u16 Surface::_pixels[SCREEN_WIDTH * SCREEN_HEIGHT] __attribute__((aligned(32)));
+struct Surface::rect Surface::_dirty[SURFACE_DIRTY_RECTS];
+int Surface::_numDirty = 0;
+
 class Editor {
 public:
     const char *description;
@@ -97,20 +432,21 @@ public:
      */
     virtual void handleTouch() = 0;
 
+    /**
+     * editors call this whenever they change a value
+     */
+    static void touched() { patchRevision++; }
+
     /**
      * display the information about the current editor
      */
-    void printInfo() { printf("%s", description); }
+    void printInfo() { text.print(description); }
 
     /**
      * clear the editor
      */
     void clear() {
-        for (int i = SCREEN_PADDING; i <= SCREEN_WIDTH - SCREEN_PADDING; i++) {
-            for (int j = SCREEN_PADDING; j <= SCREEN_HEIGHT - SCREEN_PADDING; j++) {
-                VRAM_A[256 * j + i] = RGB15(0, 0, 0);
-            }
-        }
+        Surface::fillRect(SCREEN_PADDING, SCREEN_PADDING, TABLE_LENGTH, TABLE_MAX, RGB15(0, 0, 0));
     }
 };
 
@@ -202,6 +538,216 @@ public:
     }
 };
 
+/**
+ * A free running counter of bus clock ticks (~33.5 MHz) made out of two cascaded
+ * hardware timers. Timer 0 belongs to the maxmod stream, so the clock lives on
+ * timers 2 and 3. Only ever use the difference between two readings, the
+ * counter wraps around every two minutes or so. Anything that can run longer than
+ * that has to be added up from shorter laps.
+ */
+class Clock {
+public:
+    static void init() {
+        TIMER_CR(CLOCK_TIMER) = 0;
+        TIMER_CR(CLOCK_TIMER + 1) = 0;
+        TIMER_DATA(CLOCK_TIMER) = 0;
+        TIMER_DATA(CLOCK_TIMER + 1) = 0;
+        TIMER_CR(CLOCK_TIMER + 1) = TIMER_ENABLE | TIMER_CASCADE;
+        TIMER_CR(CLOCK_TIMER) = TIMER_ENABLE | TIMER_DIV_1;
+    }
+
+    static u32 now() {
+        u16 high, low;
+        do { // read again if the low timer overflowed in between
+            high = TIMER_DATA(CLOCK_TIMER + 1);
+            low = TIMER_DATA(CLOCK_TIMER);
+        } while (high != TIMER_DATA(CLOCK_TIMER + 1));
+        return (high << 16) | low;
+    }
+
+    /**
+     * @return the ticks since the last lap (or since the reading lap holds) and starts
+     *  the next lap. adding laps up into a u64 times things that take longer than the
+     *  counter takes to wrap, as long as each lap is shorter than that
+     */
+    static u32 lap(u32 & last) {
+        u32 current = now();
+        u32 ticks = current - last;
+        last = current;
+        return ticks;
+    }
+
+    static int ticksToMilliseconds(u64 ticks) {
+        return (ticks * 1000) / BUS_CLOCK;
+    }
+};
+
+/**
+ * Remembers the slowest audio callback for the benchmark to report. Slowest means the
+ * most time per sample it made, so a callback that has a note on (or anything else
+ * spiky) in it stands out even when the average is fine.
+ */
+class CallbackTimer {
+public:
+    static void record(u32 ticks, int length) {
+        if (_worstLength == 0 || (u64)ticks * _worstLength > (u64)_worstTicks * length) {
+            _worstTicks = ticks;
+            _worstLength = length;
+        }
+    }
+
+    /**
+     * @return the slowest callback since the last time this was called, as a percentage
+     *  of the time its samples take to play
+     */
+    static int takeWorstPercent(int samplingRate) {
+        int percent = 0;
+        if (_worstLength)
+            percent = ((u64)_worstTicks * samplingRate * 100) / ((u64)_worstLength * BUS_CLOCK);
+        _worstTicks = 0;
+        _worstLength = 0;
+        return percent;
+    }
+
+private:
+    static u32 _worstTicks;
+    static int _worstLength;
+};
+
+u32 CallbackTimer::_worstTicks = 0;
+int CallbackTimer::_worstLength = 0;
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The oscilloscope
+ * The top screen shows what's actually going out to the speakers, behind the console
+ * text. The audio callback is the only thing that writes to the ring, and the main loop
+ * is the only thing that reads it, so there's no locking. write copies every
+ * SCOPE_STRIDE'th sample in, then moves the write count on once for the whole block.
+ * draw only reads points the count says are in. If the callback laps the reader, the
+ * trace is torn for a frame and nothing worse.
+ *
+ * draw runs once per frame, right after VBlank. At the start of each sweep it lines the
+ * trace up on a rising zero crossing, so a steady note stands still, and takes a copy
+ * of the 256 points. Each column remembers the span it drew last time, and only the
+ * pixels that changed are written. Noise can change nearly every pixel on the screen,
+ * and every one is a read-modify-write of VRAM, so draw stops for the frame after
+ * looking at SCOPE_PIXEL_BUDGET pixels and carries on with the sweep next frame. A
+ * quiet trace still sweeps the whole screen every frame.
+ */
+class Oscilloscope {
+public:
+    Oscilloscope() : _written{0}, _skip{0}, _pixels{NULL}, _column{0} {}
+
+    /**
+     * puts a bitmap background behind the console on the top screen. call after
+     * consoleDemoInit, which has the first 64KB of VRAM bank C for the text
+     */
+    void init() {
+        videoSetModeSub(MODE_5_2D | DISPLAY_BG0_ACTIVE | DISPLAY_BG3_ACTIVE);
+        int bg = bgInitSub(3, BgType_Bmp8, BgSize_B8_256x256, 4, 0);
+        bgSetPriority(bg, 3);
+        _pixels = bgGetGfxPtr(bg);
+        dmaFillHalfWords(0, _pixels, SCREEN_WIDTH * SCREEN_HEIGHT);
+        BG_PALETTE_SUB[SCOPE_COLOR] = RGB15(0, 14, 6);
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            _lows[x] = 1;
+            _highs[x] = 0;
+        }
+    }
+
+    /**
+     * called by the audio callback with every block that goes out
+     */
+    void write(const s16 *samples, int length) {
+        u32 written = _written;
+        int i;
+        for (i = _skip; i < length; i += SCOPE_STRIDE)
+            _ring[written++ & (SCOPE_RING - 1)] = samples[i];
+        _skip = i - length;
+        _written = written;
+    }
+
+    /**
+     * called by the main loop once per frame
+     */
+    void draw() {
+        if (_pixels == NULL)
+            return;
+        if (_column == 0)
+            startSweep();
+        int budget = SCOPE_PIXEL_BUDGET;
+        while (_column < SCREEN_WIDTH && budget > 0)
+            budget -= drawColumn(_column++);
+        if (_column == SCREEN_WIDTH)
+            _column = 0;
+    }
+
+private:
+    volatile s16 _ring[SCOPE_RING];
+    volatile u32 _written; // points ever written. the newest is at _written - 1
+    int _skip; // where in the next block the first kept sample is
+    u16 *_pixels; // VRAM, 8 bits per pixel
+    s16 _lows[SCREEN_WIDTH]; // the span each column has on the screen. empty when low > high
+    s16 _highs[SCREEN_WIDTH];
+    s16 _sweep[SCREEN_WIDTH]; // the y of each point of the sweep being drawn
+    int _column; // the next column of the sweep to draw
+
+    /**
+     * finds the trigger and copies the points from there, before the callback writes over them
+     */
+    void startSweep() {
+        u32 newest = _written;
+        u32 start = newest - SCREEN_WIDTH;
+        for (u32 back = 1; back < SCOPE_RING - SCREEN_WIDTH; back++) {
+            u32 at = newest - SCREEN_WIDTH - back;
+            if (_ring[(at - 1) & (SCOPE_RING - 1)] < 0 && _ring[at & (SCOPE_RING - 1)] >= 0) {
+                start = at;
+                break;
+            }
+        }
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+            _sweep[x] = toY(_ring[(start + x) & (SCOPE_RING - 1)]);
+    }
+
+    /**
+     * @return how many pixels it looked at
+     */
+    int drawColumn(int x) {
+        int y = _sweep[x];
+        int previousY = x ? _sweep[x - 1] : y;
+        // join this point to the last one, so steep edges don't break up into dots
+        int low = y < previousY ? y : previousY;
+        int high = y < previousY ? previousY : y;
+        int looked = 0;
+        for (int j = _lows[x]; j <= _highs[x]; j++, looked++)
+            if (j < low || j > high)
+                plot(x, j, 0);
+        for (int j = low; j <= high; j++, looked++)
+            if (j < _lows[x] || j > _highs[x])
+                plot(x, j, SCOPE_COLOR);
+        _lows[x] = low;
+        _highs[x] = high;
+        return looked;
+    }
+
+    static int toY(int sample) {
+        return SCREEN_HEIGHT / 2 - 1 - ((sample * (SCREEN_HEIGHT / 2 - 8)) >> 15);
+    }
+
+    /**
+     * VRAM can't be written a byte at a time, so this writes the pair of pixels x is in
+     */
+    void plot(int x, int y, u8 color) {
+        u16 *pair = &_pixels[(y * SCREEN_WIDTH + x) >> 1];
+        if (x & 1)
+            *pair = (*pair & 0x00ff) | (color << 8);
+        else
+            *pair = (*pair & 0xff00) | color;
+    }
+};
+
+Oscilloscope scope;
+
 // PianoKeys was copied from the addon.c example program for devkitPro
 typedef struct {
 	union {
@@ -289,11 +835,12 @@ public:
     void stopTestTone() { stopKey(0); }
 
     void printRoot() {
-        pc->cursorX = 0;
-        pc->cursorY = 23;
+        text.clearRows(23, 1);
+        text.moveTo(0, 23);
         int noteNameIndex = pitch;
         // code snippet taken from https://shadyf.com/blog/notes/2016-07-16-modulo-for-negative-numbers/
-        printf("Root: %s", noteNames[((noteNameIndex %= 12) < 0) ? noteNameIndex+12 : noteNameIndex]);
+        text.print("Root: ");
+        text.print(noteNames[((noteNameIndex %= 12) < 0) ? noteNameIndex+12 : noteNameIndex]);
     }
 
     void incPitch() {
@@ -326,6 +873,7 @@ private:
         int pitchIndex = pitch + (12 * octave) + i;
         if (pitchIndex >= 0 && pitchIndex < 120) { // only play if pitch is within the table
             sounds[i].playing = true;
+            sounds[i].justPressed = true;
             sounds[i].freq = pitches[pitch + (12 * octave) + i];
             sounds[i].phaseFramesElapsed = 0;
         }
@@ -341,10 +889,25 @@ private:
     void stopKey(int i) {
         sounds[i].playing = false;
         sounds[i].stopping = true;
-        sounds[i].justPressed = true;
     }
 };
 
+/**
+ * which columns of a table editor get a guide line. the guides divide the table into
+ * twelve, and are worked out by the compiler rather than checked for every point drawn
+ */
+class GuideMask {
+public:
+    constexpr GuideMask() : columns {} {
+        for (int k = 1; k < 12; k++)
+            columns[k*TABLE_LENGTH/12] = true;
+    }
+
+    bool columns[TABLE_LENGTH];
+};
+
+constexpr GuideMask guideMask;
+
 class Table : public Editor {
 public:
     Table(const char * description, s16 (&table_)[TABLE_LENGTH]) : Editor(description), table(table_) {
@@ -357,10 +920,11 @@ public:
  
     void draw() {
         printInfo();
+        clear();
         for (int i = 0; i < TABLE_LENGTH; i++) {
-            int x = i + SCREEN_PADDING;
-            int y = table[i] + SCREEN_PADDING;
-            setPixel(x, y);
+            if (guideMask.columns[i])
+                Surface::fillColumn(i + SCREEN_PADDING, SCREEN_PADDING, TABLE_MAX, RGB15(10, 10, 10));
+            Surface::setPixel(i + SCREEN_PADDING, table[i] + SCREEN_PADDING, RGB15(31, 31, 31));
         }
     }
 
@@ -391,44 +955,31 @@ private:
     int previousY;
     bool hasLifted;
     
+    /**
+     * sets the table at x to y. the screen already shows every other point of the
+     * table, so only the old point and the new one are repainted
+     */
     void setPixel(int x, int y) {
         // make sure the input is within bounds
         if (x < SCREEN_PADDING) x = SCREEN_PADDING;
         if (x > SCREEN_WIDTH - SCREEN_PADDING) x = SCREEN_WIDTH - SCREEN_PADDING;
         if (y < SCREEN_PADDING) y = SCREEN_PADDING;
         if (y > SCREEN_HEIGHT - SCREEN_PADDING) y = SCREEN_HEIGHT - SCREEN_PADDING;
-        
-        // display guiding lines that divide the screen equally into twelve parts
-        int tableX = x - SCREEN_PADDING;
-        bool guider = false;
-        for (int k = 1; k < 12; k++) {
-            if (tableX == k*TABLE_LENGTH/12) {
-                guider = true;
-                break;
-            } 
-        }
-
-        // make the pixel at position white, and everything above and below black
-        for (int i = SCREEN_PADDING; i <= SCREEN_HEIGHT - SCREEN_PADDING; i++) {
-            if (i == y)
-                VRAM_A[256 * i + x] = RGB15(31, 31, 31);
-            else {
-                if (guider)
-                    VRAM_A[256 * i + x] = RGB15(10, 10, 10);
-                else
-                    VRAM_A[256 * i + x] = RGB15(0, 0, 0);
-            }
-        }
 
-        table[x - SCREEN_PADDING] = y - SCREEN_PADDING;
+        int tableX = x - SCREEN_PADDING;
+        int old = table[tableX] + SCREEN_PADDING;
+        if (old == y)
+            return;
+        Surface::setPixel(x, old, guideMask.columns[tableX] ? RGB15(10, 10, 10) : RGB15(0, 0, 0));
+        Surface::setPixel(x, y, RGB15(31, 31, 31));
+        table[tableX] = y - SCREEN_PADDING;
+        touched();
     }
 
     /**
-     * NOTE TO FUTURE PROGRAMMERS
-     * 
-     * Welcome to probably the derpiest line drawing algorithm in existance. It works,
-     * but only barely, and honestly that depends on how we define "works." It does everything
-     * it needs to, but boy oh boy it is a stretch to call the this a line drawing algorithm.
+     * sets every column from x1 to x2 once, to the nearest point on the line between the
+     * ends. the y steps are added up with a remainder the way Bresenham does it, so
+     * there's no dividing per column and nothing gets skipped
      */
     void drawLine(int x1, int y1, int x2, int y2) {
         if (x1 == x2) {
@@ -443,10 +994,21 @@ private:
             y1 = y2;
             y2 = temp;
         }
-        for (int i = x1; i <= x2; i++) {
-            int currX = i;
-            int currY = y1 + ((y2 - y1) / ((x2 - x1) / (i - x1)));
-            setPixel(currX, currY);
+        int dx = x2 - x1;
+        int dy = y2 - y1;
+        int direction = dy < 0 ? -1 : 1;
+        int whole = dy / dx; // how far y moves every column
+        int part = (dy - whole * dx) * direction; // and the remainder, out of dx
+        int error = dx / 2; // so y rounds to the nearest pixel rather than down
+        int y = y1;
+        for (int x = x1; x <= x2; x++) {
+            setPixel(x, y);
+            y += whole;
+            error += part;
+            if (error >= dx) {
+                error -= dx;
+                y += direction;
+            }
         }
     }
 };
@@ -483,7 +1045,11 @@ public:
             previousX = x;
 
             // scale x properly and set the internal time variable
-            val = ((x - SCREEN_PADDING) * maxVal) / TABLE_LENGTH;
+            int newVal = ((x - SCREEN_PADDING) * maxVal) / TABLE_LENGTH;
+            if (newVal != val) {
+                val = newVal;
+                touched();
+            }
         }
     }
 
@@ -493,22 +1059,22 @@ private:
     int maxVal;
     touchPosition touch;
     void drawSliderLine(int x) {
-        for (int i = SCREEN_PADDING; i <= SCREEN_HEIGHT - SCREEN_PADDING; i++) {
-            VRAM_A[256 * i + previousX] = RGB15(0, 0, 0);
-            VRAM_A[256 * i + x] = RGB15(31, 31, 31);
-        }
+        Surface::fillColumn(previousX, SCREEN_PADDING, TABLE_MAX, RGB15(0, 0, 0));
+        Surface::fillColumn(x, SCREEN_PADDING, TABLE_MAX, RGB15(31, 31, 31));
     }
 };
 
 class Switch : public Editor {
 public:
-    Switch(const char * description, int &val_, int numOptions_) : Editor(description), val(val_), numOptions{numOptions_} {}
+    Switch(const char * description, int &val_, int numOptions_) : Editor(description), val(val_), numOptions{numOptions_}, drawnVal{-1} {}
 
     void handleTouch() {
         int keysH = keysHeld();
         if (keysH & KEY_TOUCH) {
             touchRead(&touch);
             
+            int oldVal = val;
+
             // asign the value
             val = touch.px >= SCREEN_WIDTH / 2;
 
@@ -519,6 +1085,8 @@ public:
                     break;
                 }
             }
+            if (val != oldVal)
+                touched();
 
             // redisplay the switch
             drawSwitch();
@@ -527,23 +1095,32 @@ public:
 
     void draw() {
         printInfo();
+        clear();
+        drawnVal = -1;
         drawSwitch();
     }
 private:
     int &val;
     int numOptions;
+    int drawnVal; // the option that's white on the screen, -1 for none
     touchPosition touch;
 
+    /**
+     * paints the old option black and the new one white, if it changed
+     */
     void drawSwitch() {
-        for (int i = SCREEN_PADDING; i <= SCREEN_WIDTH - SCREEN_PADDING; i++) {
-            for (int j = SCREEN_PADDING; j <= SCREEN_HEIGHT - SCREEN_PADDING; j++) {
-                int x = i - SCREEN_PADDING;
-                if ((val*TABLE_LENGTH)/numOptions <= x && x < ((val + 1)*TABLE_LENGTH)/numOptions)
-                    VRAM_A[256 * j + i] = RGB15(31, 31, 31);
-                else
-                    VRAM_A[256 * j + i] = RGB15(0, 0, 0);
-            }
-        }
+        if (val == drawnVal)
+            return;
+        if (drawnVal >= 0)
+            fillOption(drawnVal, RGB15(0, 0, 0));
+        fillOption(val, RGB15(31, 31, 31));
+        drawnVal = val;
+    }
+
+    void fillOption(int option, u16 color) {
+        int left = (option*TABLE_LENGTH)/numOptions;
+        int right = ((option + 1)*TABLE_LENGTH)/numOptions;
+        Surface::fillRect(SCREEN_PADDING + left, SCREEN_PADDING, right - left, TABLE_MAX, color);
     }
 };
 
@@ -558,6 +1135,7 @@ public:
     {
         for (int i = 0; i < _numSliders; i++) {
             _sliders[i].rawx = _vals[i] + SCREEN_PADDING;
+            _sliders[i].drawnx = -1;
         }
     }
 
@@ -567,6 +1145,10 @@ public:
             touchRead(&touch);
             if (_hasLifted) {
                 _currentSliderHeld = (touch.py - SCREEN_PADDING) * _numSliders / TABLE_MAX;
+                if (_currentSliderHeld < 0)
+                    _currentSliderHeld = 0;
+                if (_currentSliderHeld >= _numSliders)
+                    _currentSliderHeld = _numSliders - 1;
                _hasLifted = false;
             }
 
@@ -577,7 +1159,11 @@ public:
                 x = SCREEN_WIDTH - SCREEN_PADDING;
 
             _sliders[_currentSliderHeld].rawx = x;
-            _vals[_currentSliderHeld] = ((x - SCREEN_PADDING) * _maxVal) / TABLE_MAX;
+            int newVal = ((x - SCREEN_PADDING) * _maxVal) / TABLE_MAX;
+            if (newVal != _vals[_currentSliderHeld]) {
+                _vals[_currentSliderHeld] = newVal;
+                touched();
+            }
 
             drawSlider(_currentSliderHeld);
             
@@ -601,30 +1187,36 @@ private:
 
     struct slider {
         int rawx;
+        int drawnx; // where the line is on the screen, -1 if the band hasn't been drawn
     };
 
     struct slider _sliders[8]; // multislider has max of 8 sliders
 
+    /**
+     * moves the slider's line, or draws the whole band if it isn't on the screen yet
+     */
     void drawSlider(int slider) {
-
         int x = _sliders[slider].rawx;
+        int drawnx = _sliders[slider].drawnx;
+        if (x == drawnx)
+            return;
         int yLow = SCREEN_PADDING + (slider*TABLE_MAX / _numSliders);
         int yHigh = SCREEN_PADDING + ((slider + 1)*TABLE_MAX / _numSliders) - 1;
-        for (int i = SCREEN_PADDING; i <= SCREEN_WIDTH - SCREEN_PADDING; i++) {
-            for (int j = yLow; j < yHigh; j++) {
-                if (i == x)
-                    VRAM_A[256 * j + i] = RGB15(31, 31, 31);
-                else
-                    VRAM_A[256 * j + i] = RGB15(0, 0, 0);
-            }
-            if (yHigh < SCREEN_PADDING + SCREEN_HEIGHT)
-                VRAM_A[256 * yHigh + i] = RGB15(10, 10, 10);
-        }  
+        if (drawnx < 0) {
+            Surface::fillRect(SCREEN_PADDING, yLow, TABLE_LENGTH, yHigh - yLow, RGB15(0, 0, 0));
+            Surface::fillRect(SCREEN_PADDING, yHigh, TABLE_LENGTH, 1, RGB15(10, 10, 10));
+        } else {
+            Surface::fillColumn(drawnx, yLow, yHigh - yLow, RGB15(0, 0, 0));
+        }
+        Surface::fillColumn(x, yLow, yHigh - yLow, RGB15(31, 31, 31));
+        _sliders[slider].drawnx = x;
     }
 
     void drawSliders() {
-        for (int i = 0; i < _numSliders; i++)
+        for (int i = 0; i < _numSliders; i++) {
+            _sliders[i].drawnx = -1;
             drawSlider(i);
+        }
     }
 };
 
@@ -639,6 +1231,7 @@ public:
     {
         for (int i = 0; i < _numSwitches; i++) {
             _switches[i].rawx = SCREEN_PADDING;
+            _switches[i].drawnVal = -1;
         }
     }
 
@@ -648,6 +1241,10 @@ public:
             touchRead(&touch);
             if (_hasLifted) {
                 _currentSwitchHeld = (touch.py - SCREEN_PADDING) * _numSwitches / TABLE_MAX;
+                if (_currentSwitchHeld < 0)
+                    _currentSwitchHeld = 0;
+                if (_currentSwitchHeld >= _numSwitches)
+                    _currentSwitchHeld = _numSwitches - 1;
                _hasLifted = false;
             }
 
@@ -658,7 +1255,11 @@ public:
                 x = SCREEN_WIDTH - SCREEN_PADDING;
 
             _switches[_currentSwitchHeld].rawx = x;
-            _vals[_currentSwitchHeld] = ((x - SCREEN_PADDING) * _maxVal) / TABLE_LENGTH;
+            int newVal = ((x - SCREEN_PADDING) * _maxVal) / TABLE_LENGTH;
+            if (newVal != _vals[_currentSwitchHeld]) {
+                _vals[_currentSwitchHeld] = newVal;
+                touched();
+            }
 
             drawSwitch(_currentSwitchHeld);
             
@@ -682,31 +1283,43 @@ private:
 
     struct switchInfo {
         int rawx;
+        int drawnVal; // the value that's white on the screen, -1 if the band hasn't been drawn
     };
 
     struct switchInfo _switches[8]; // multiswitch has max of 8 switches
 
+    /**
+     * paints the old value's cell black and the new one's white, or draws the whole band
+     * if it isn't on the screen yet
+     */
     void drawSwitch(int whichSwitch) {
-
-        //int x = _switches[whichSwitch].rawx - SCREEN_PADDING;
+        int val = _vals[whichSwitch];
+        int drawnVal = _switches[whichSwitch].drawnVal;
+        if (val == drawnVal)
+            return;
         int yLow = SCREEN_PADDING + (whichSwitch*TABLE_MAX / _numSwitches);
         int yHigh = SCREEN_PADDING + ((whichSwitch + 1)*TABLE_MAX / _numSwitches) - 1;
-        for (int i = SCREEN_PADDING; i <= SCREEN_WIDTH - SCREEN_PADDING; i++) {
-            int x = i - SCREEN_PADDING;
-            for (int j = yLow; j < yHigh; j++) {
-                if ((_vals[whichSwitch]*TABLE_LENGTH)/_maxVal <= x && x < ((_vals[whichSwitch] + 1)*TABLE_LENGTH)/_maxVal)
-                    VRAM_A[256 * j + i] = RGB15(31, 31, 31);
-                else
-                    VRAM_A[256 * j + i] = RGB15(0, 0, 0);
-            }
-            if (yHigh < SCREEN_PADDING + SCREEN_HEIGHT)
-                VRAM_A[256 * yHigh + i] = RGB15(10, 10, 10);
-        }  
+        if (drawnVal < 0) {
+            Surface::fillRect(SCREEN_PADDING, yLow, TABLE_LENGTH, yHigh - yLow, RGB15(0, 0, 0));
+            Surface::fillRect(SCREEN_PADDING, yHigh, TABLE_LENGTH, 1, RGB15(10, 10, 10));
+        } else {
+            fillCell(drawnVal, yLow, yHigh - yLow, RGB15(0, 0, 0));
+        }
+        fillCell(val, yLow, yHigh - yLow, RGB15(31, 31, 31));
+        _switches[whichSwitch].drawnVal = val;
+    }
+
+    void fillCell(int val, int y, int height, u16 color) {
+        int left = (val*TABLE_LENGTH)/_maxVal;
+        int right = ((val + 1)*TABLE_LENGTH)/_maxVal;
+        Surface::fillRect(SCREEN_PADDING + left, y, right - left, height, color);
     }
 
     void drawSwitches() {
-        for (int i = 0; i < _numSwitches; i++)
+        for (int i = 0; i < _numSwitches; i++) {
+            _switches[i].drawnVal = -1;
             drawSwitch(i);
+        }
     }
 };
 
@@ -729,6 +1342,21 @@ public:
         state.a = 347810;
     }
 
+    /**
+     * starts the stream over. the same seed always gives the same numbers, so a synth
+     * that seeds each voice its own way renders the same thing every time
+     */
+    void seed(uint32_t seed) {
+        state.a = seed ? seed : 347810;
+    }
+
+    /**
+     * @return a seed that's different for every key, so each voice gets its own stream
+     */
+    static uint32_t seedFor(int key) {
+        return 2654435761u * (key + 1);
+    }
+
     /**
      * @return true half of the time
      */
@@ -737,24 +1365,51 @@ public:
     }
 
     /**
-     * @return true a out of b times
+     * work this out when the probability changes, not every sample
+     *
+     * @return a threshold for chance() that comes true a out of b times. 0 is never and a
+     *  of b or more is always, because xorshift never gives 0
      */
-    bool prob(uint32_t a, uint32_t b) {
-        if (a == 0) {
-            return false;
-        } else if (a == b) {
-            return true;
-        } else {
-            return xorshift32(&state) % b <= a;
+    static uint32_t threshold(uint32_t a, uint32_t b) {
+        if (a >= b)
+            return 0xffffffff;
+        return ((uint64_t)a << 32) / b;
+    }
+
+    /**
+     * @param threshold from threshold()
+     */
+    bool chance(uint32_t threshold) {
+        return xorshift32(&state) <= threshold;
+    }
+
+    /**
+     * a block of chances at once, one bit each. bit i % 32 of bits[i / 32] is whether
+     * chance i came true. never and always are filled in without using up any numbers
+     */
+    void chances(uint32_t *bits, int length, uint32_t threshold) {
+        int words = (length + 31) >> 5;
+        if (threshold == 0 || threshold == 0xffffffff) {
+            for (int i = 0; i < words; i++)
+                bits[i] = threshold;
+            return;
+        }
+        for (int i = 0; i < words; i++) {
+            int count = length - (i << 5) < 32 ? length - (i << 5) : 32;
+            uint32_t word = 0;
+            for (int j = 0; j < count; j++)
+                word |= (uint32_t)(xorshift32(&state) <= threshold) << j;
+            bits[i] = word;
         }
     }
 
     /**
-     * fills an array with random values
+     * fills an array with random values from 0 to max - 1, scaled with a multiply rather
+     * than a modulo
      */
     void randArray(s16 * arr, int length, int max) {
         for (int i = 0 ; i < length; i++) {
-            arr[i] = xorshift32(&state) % max;
+            arr[i] = ((uint64_t)xorshift32(&state) * max) >> 32;
         }
     }
 private:
@@ -776,46 +1431,811 @@ private:
     }
 };
 
+/**
+ * An editor value used as a probability out of some maximum. The threshold Random::chance
+ * wants is only worked out again when the editor changes.
+ */
+class Probability {
+public:
+    Probability(int &amount, int outOf) :
+        _amount (amount),
+        _outOf {outOf},
+        _cachedAmount {-1},
+        _threshold {0} {}
+
+    uint32_t threshold() {
+        if (_amount != _cachedAmount) {
+            _cachedAmount = _amount;
+            _threshold = Random::threshold(_amount, _outOf);
+        }
+        return _threshold;
+    }
+
+private:
+    int &_amount;
+    int _outOf;
+    int _cachedAmount;
+    uint32_t _threshold;
+};
+
 
 mm_ds_system sys;
 mm_stream mystream;
 
 /**
- * sinLerp angle from -32768 to 32767. range of 65535
+ * One cycle of a sine wave, out of 32767, worked out by the compiler so the DS never
+ * has to. The angle wraps with the table, so index it with the top SINE_BITS of an angle.
  */
-class Sine {
+class SineTable {
 public:
-    int _framesElapsed;
-    int64 _phase;
+    constexpr SineTable() : values {} {
+        for (int i = 0; i < SINE_LENGTH; i++)
+            values[i] = (s16)round(32767 * taylorSin(i));
+    }
 
-    Sine(int samplingRate) :
-        _framesElapsed {0},
-        _samplingRate{samplingRate},
-        _t{0},
-        _freq{0} {}
+    /**
+     * @param angle 1 << ANGLE_BITS is a whole circle. wraps around
+     * @return the sine of the angle, out of 32767
+     */
+    constexpr int sin(int angle) const { return values[(angle >> (ANGLE_BITS - SINE_BITS)) & (SINE_LENGTH - 1)]; }
+    constexpr int cos(int angle) const { return sin(angle + (1 << (ANGLE_BITS - 2))); }
 
-    void reset() { _t = 0; _framesElapsed = 0; }
+    /**
+     * @param phase a whole circle is the whole 32 bits
+     * @return the sine of the phase, out of 32767. interpolated between the table entries
+     *  either side of it if SINE_INTERPOLATE is on
+     */
+    constexpr int lookup(u32 phase) const {
+#if SINE_INTERPOLATE
+        int i = phase >> (32 - SINE_BITS);
+        int a = values[i];
+        int b = values[(i + 1) & (SINE_LENGTH - 1)];
+        int fraction = (phase >> (32 - SINE_BITS - 15)) & 0x7fff;
+        return a + (((b - a) * fraction) >> 15);
+#else
+        return values[phase >> (32 - SINE_BITS)];
+#endif
+    }
 
-    /*int largePhase() {
-        return (_framesElapsed++ * _freq * 65536) / _samplingRate;
-    }*/
+    s16 values[SINE_LENGTH];
 
-    s16 sin(int freq) {
-        _phase = ((_t++ - 32768) * (_freq = freq) * 65536) / _samplingRate;
-        if (_phase > 32767) {
-            _phase -= 65536;
-            _t = 0;
-        }
-        return sinLerp(_phase);
+private:
+    static constexpr double PI = 3.14159265358979323846;
+
+    static constexpr double round(double x) { return x < 0 ? -(double)(long)(0.5 - x) : (double)(long)(x + 0.5); }
+
+    /**
+     * sin(2 * pi * i / SINE_LENGTH) by Taylor series, folded into -pi/2 to pi/2 where
+     * it converges quickly
+     */
+    static constexpr double taylorSin(int i) {
+        double x = 2 * PI * i / SINE_LENGTH;
+        if (x > PI)
+            x -= 2 * PI;
+        if (x > PI / 2)
+            x = PI - x;
+        if (x < -PI / 2)
+            x = -PI - x;
+        double term = x;
+        double sum = x;
+        for (int n = 1; n < 12; n++) {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sum += term;
+        }
+        return sum;
     }
-    
+};
+
+constexpr SineTable sineTable;
+
+/**
+ * The polyBLEP residual: how much to bend the samples either side of a jump in a wave so
+ * that the jump sounds like it went through a low pass filter instead of aliasing. For a
+ * jump that happened x of the way between two samples, the sample before it moves by
+ * x^2 of half the jump and the one after by (1 - x)^2 of half the jump, the other way.
+ * The table holds x^2 out of 32767, so both are a lookup and a multiply.
+ */
+class BlepTable {
+public:
+    constexpr BlepTable() : values {} {
+        for (int i = 0; i < BLEP_LENGTH; i++)
+            values[i] = (s16)((32767 * i * i) / (BLEP_LENGTH * BLEP_LENGTH));
+    }
+
+    s16 values[BLEP_LENGTH];
+};
+
+constexpr BlepTable blepTable;
+
+/**
+ * A fixed point radix 2 FFT and the polar conversions that go with it. Nothing here is
+ * fast enough to run per sample. It's for working out tables in the background.
+ */
+class Fft {
+public:
+    /**
+     * transforms re and im in place
+     *
+     * @param bits log2 of the length. the length must not be more than SINE_LENGTH
+     * @param inverse forward transforms are scaled by 1 / length so they can't overflow,
+     *  inverse transforms aren't, so an inverse undoes a forward
+     */
+    static void transform(int *re, int *im, int bits, bool inverse) {
+        int length = 1 << bits;
+
+        // put everything in bit reversed order
+        for (int i = 1, j = 0; i < length; i++) {
+            int bit = length >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j |= bit;
+            if (i < j) {
+                int t = re[i]; re[i] = re[j]; re[j] = t;
+                t = im[i]; im[i] = im[j]; im[j] = t;
+            }
+        }
+
+        for (int half = 1; half < length; half <<= 1) {
+            int angleStep = (1 << ANGLE_BITS) / (2 * half);
+            for (int k = 0; k < half; k++) {
+                int angle = inverse ? k * angleStep : -k * angleStep;
+                int wr = sineTable.cos(angle);
+                int wi = sineTable.sin(angle);
+                for (int i = k; i < length; i += 2 * half) {
+                    int j = i + half;
+                    int tr = (int)(((s64)re[j] * wr - (s64)im[j] * wi) >> 15);
+                    int ti = (int)(((s64)re[j] * wi + (s64)im[j] * wr) >> 15);
+                    if (inverse) {
+                        re[j] = re[i] - tr;
+                        im[j] = im[i] - ti;
+                        re[i] += tr;
+                        im[i] += ti;
+                    } else {
+                        re[j] = (re[i] - tr) >> 1;
+                        im[j] = (im[i] - ti) >> 1;
+                        re[i] = (re[i] + tr) >> 1;
+                        im[i] = (im[i] + ti) >> 1;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * CORDIC in vectoring mode: turns (x, y) into a magnitude and an angle with nothing
+     * but shifts and adds. x and y should stay under 1 << 28
+     *
+     * @param angle set from 0 to 1 << ANGLE_BITS
+     */
+    static void toPolar(int x, int y, int &magnitude, int &angle) {
+        static const int atanTable[16] = {8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5, 3, 1, 1, 0};
+        angle = 0;
+        if (x < 0) { // CORDIC only converges in the right half plane
+            x = -x;
+            y = -y;
+            angle = 1 << (ANGLE_BITS - 1);
+        }
+        for (int i = 0; i < 16; i++) {
+            int dx = y >> i;
+            int dy = x >> i;
+            if (y > 0) {
+                x += dx;
+                y -= dy;
+                angle += atanTable[i];
+            } else {
+                x -= dx;
+                y += dy;
+                angle -= atanTable[i];
+            }
+        }
+        magnitude = (int)(((s64)x * 39797) >> 16); // undo the CORDIC gain of about 1.647
+        angle &= (1 << ANGLE_BITS) - 1;
+    }
+
+    /**
+     * @param angle 1 << ANGLE_BITS is a whole circle
+     */
+    static void fromPolar(int magnitude, int angle, int &x, int &y) {
+        x = (int)(((s64)magnitude * sineTable.cos(angle)) >> 15);
+        y = (int)(((s64)magnitude * sineTable.sin(angle)) >> 15);
+    }
+};
+
+/**
+ * Halves the sampling rate of a stream of samples without letting what's above the new
+ * Nyquist frequency fold back down. It's a half band FIR filter, which is the cheap kind:
+ * every other coefficient is 0 apart from the middle one, which is a half. Split into its
+ * two polyphase branches, one branch is just the middle tap and the other is
+ * HALFBAND_PAIRS symmetric pairs, so each output sample costs HALFBAND_PAIRS multiplies.
+ *
+ * The coefficients are a Kaiser windowed sinc out of 32768. Everything below about 0.35 of
+ * the output rate comes through flat, and aliases are down about 60 dB.
+ */
+class HalfBand {
+public:
+    HalfBand() : _history {}, _position {0} {}
+
+    void reset() {
+        for (int i = 0; i < HALFBAND_HISTORY; i++)
+            _history[i] = 0;
+    }
+
+    /**
+     * decimates in place
+     *
+     * @param length how many samples to read. must be even. length / 2 are written back
+     *  to the start of samples
+     */
+    void decimate(int *samples, int length) {
+        static const int coefficients[HALFBAND_PAIRS] = {10265, -3000, 1372, -635, 259, -81, 12};
+        const int mask = HALFBAND_HISTORY - 1;
+        for (int i = 0; i < length; i += 2) {
+            _history[_position++ & mask] = samples[i];
+            _history[_position++ & mask] = samples[i + 1];
+            u32 middle = _position - 2 * HALFBAND_PAIRS;
+            s64 sum = (s64)_history[middle & mask] << 14;
+            for (int j = 0; j < HALFBAND_PAIRS; j++) {
+                int pair = _history[(middle - 2 * j - 1) & mask] + _history[(middle + 2 * j + 1) & mask];
+                sum += (s64)pair * coefficients[j];
+            }
+            samples[i >> 1] = (int)(sum >> 15);
+        }
+    }
+
 private:
-    int _samplingRate;
-    int64 _t;
-    int _freq;
-    
+    int _history[HALFBAND_HISTORY];
+    u32 _position; // only ever goes up, and wraps around. the history is indexed by its low bits
+};
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - Control rate
+ *
+ * Things like LFOs, envelopes and the position in the transition shape change slowly,
+ * so there's no reason to work them out again for every single sample. Synths that
+ * care about this split their work in two:
+ * 1. a control tick every CONTROL_PERIOD samples, where the slow stuff is worked out
+ *    once per voice and turned into a start value and a per sample step (a ramp)
+ * 2. the audio rate loop, which only adds the step to the ramp and does the cheap
+ *    per sample work
+ *
+ * Modulation sources all speak the same language: fixed point numbers where MOD_ONE
+ * means "all the way". LFOs go from -MOD_ONE to MOD_ONE, envelopes from 0 to MOD_ONE.
+ */
+
+/**
+ * A triangle LFO with a 32 bit phase. Meant to be ticked once per control period.
+ */
+class Lfo {
+public:
+    Lfo() { reset(); }
+
+    /**
+     * starts the LFO at the middle of its upward slope so that notes start unmodulated
+     */
+    void reset() { _phase = 0x40000000; }
+
+    /**
+     * @param increment how far to advance the phase. 1 << 32 is one whole cycle
+     * @return the LFO output, from -MOD_ONE to MOD_ONE
+     */
+    int tick(u32 increment) {
+        _phase += increment;
+        int p = _phase >> (32 - MOD_SHIFT - 2); // [0, 4 * MOD_ONE)
+        if (p < 2 * MOD_ONE)
+            return p - MOD_ONE;
+        else
+            return 3 * MOD_ONE - p;
+    }
+
+    /**
+     * @param hundredthsOfHz LFO rate
+     * @param tickRate how many times per second tick() is called
+     */
+    static u32 increment(int hundredthsOfHz, int tickRate) {
+        return ((u64)hundredthsOfHz << 32) / (100 * tickRate);
+    }
+
+private:
+    u32 _phase;
+};
+
+/**
+ * An envelope that jumps to MOD_ONE when a note starts and decays exponentially
+ * towards zero, one multiply per control tick.
+ */
+class Envelope {
+public:
+    Envelope() : _level{0} {}
+
+    void trigger() { _level = MOD_ONE << ENVELOPE_EXTRA_BITS; }
+
+    /**
+     * @param coefficient how much of the level is lost per tick, out of 1 << 16
+     * @return the envelope level, from 0 to MOD_ONE
+     */
+    int tick(int coefficient) {
+        _level -= (int)(((s64)_level * coefficient) >> 16);
+        return _level >> ENVELOPE_EXTRA_BITS;
+    }
+
+    /**
+     * @param milliseconds roughly how long it takes to fade away (one time constant)
+     * @param tickRate how many times per second tick() is called
+     */
+    static int coefficient(int milliseconds, int tickRate) {
+        int ticks = (milliseconds * tickRate) / 1000;
+        return (1 << 16) / (ticks + 1);
+    }
+
+private:
+    int _level; // MOD_ONE << ENVELOPE_EXTRA_BITS is full scale. the extra bits keep slow decays from stalling
+};
+
+/**
+ * A small modulation matrix. Each route connects a modulation source to a destination,
+ * with an amount set by an editor. Synths hand it the current value of every source
+ * during their control tick and ask it how much a destination should move.
+ */
+class ModMatrix {
+public:
+    enum Source { SOURCE_LFO, SOURCE_ENVELOPE, NUM_SOURCES };
+    enum Destination { DEST_WAVE_POSITION, DEST_FM_AMP, NUM_DESTINATIONS };
+
+    /**
+     * @param vals the values of the modulation editor. their layout is described by
+     *  the MOD_* indexes
+     */
+    ModMatrix(int (&vals)[8]) :
+        _vals (vals),
+        _routes {
+            {SOURCE_LFO, DEST_WAVE_POSITION, MOD_LFO_TO_POSITION},
+            {SOURCE_ENVELOPE, DEST_FM_AMP, MOD_ENVELOPE_TO_FM_AMP}
+        } {}
+
+    /**
+     * @param sources the current value of every source, indexed by Source
+     * @return the sum of every route into dest, from -MOD_ONE to MOD_ONE per route
+     */
+    int modulation(Destination dest, const int (&sources)[NUM_SOURCES]) {
+        int total = 0;
+        for (int i = 0; i < NUM_ROUTES; i++) {
+            if (_routes[i].dest == dest)
+                total += (sources[_routes[i].source] * amount(i)) / MOD_AMOUNT_MAX;
+        }
+        return total;
+    }
+
+    /**
+     * @return the combined amount of every route into dest, from 0 to MOD_ONE per route
+     */
+    int depth(Destination dest) {
+        int total = 0;
+        for (int i = 0; i < NUM_ROUTES; i++) {
+            if (_routes[i].dest == dest)
+                total += (MOD_ONE * amount(i)) / MOD_AMOUNT_MAX;
+        }
+        return total;
+    }
+
+    /**
+     * @return the LFO rate in hundredths of a hertz
+     */
+    int lfoRate() { return 10 * clampedVal(MOD_LFO_RATE); }
+
+    /**
+     * @return the envelope decay time in milliseconds
+     */
+    int envelopeDecay() { return 16 * clampedVal(MOD_ENVELOPE_DECAY); }
+
+private:
+    static const int NUM_ROUTES = 2;
+
+    struct route {
+        Source source;
+        Destination dest;
+        int val; // which editor value holds the amount
+    };
+
+    int (&_vals)[8];
+    struct route _routes[NUM_ROUTES];
+
+    int amount(int route) { return clampedVal(_routes[route].val); }
+
+    int clampedVal(int i) {
+        if (_vals[i] < 0)
+            return 0;
+        if (_vals[i] > MOD_AMOUNT_MAX)
+            return MOD_AMOUNT_MAX;
+        return _vals[i];
+    }
+};
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The amplitude envelope
+ *
+ * Every synth's output goes through one shared attack, decay, sustain, release envelope
+ * on its way into the mix, so your synth doesn't need to fade its own notes in and out.
+ * Synth::mixVoices takes care of it. Each key keeps its own EnvelopeState in its SoundInfo.
+ *
+ * The segments are exponential. Each control tick moves the level a fixed fraction of the
+ * way towards a target, which is one multiply. Between ticks the gain ramps linearly,
+ * which is one add per sample. The attack aims a bit past full scale and the release a
+ * bit below silence, so both actually get there instead of creeping up on it forever.
+ *
+ * Once the release reaches silence the key stops sounding, and mixVoices skips it
+ * entirely, so released notes stop costing anything as soon as they're quiet.
+ */
+class AmpEnvelope {
+public:
+    enum { STAGE_OFF, STAGE_ATTACK, STAGE_DECAY, STAGE_SUSTAIN, STAGE_RELEASE };
+
+    AmpEnvelope() :
+        vals {0, 0, MOD_AMOUNT_MAX, 0},
+        _tickRate {-1} {}
+
+    int vals[8]; // set by the amplitude envelope editor. laid out by the AMP_* indexes
+
+    /**
+     * @return whether the key is held or still fading out. keys that aren't sounding
+     *  don't need to be rendered
+     */
+    bool sounding(struct SoundInfo * sound) {
+        return sound->playing || sound->envelope.stage != STAGE_OFF;
+    }
+
+    /**
+     * starts the attack when a key goes down and the release when it comes up. the level
+     * carries on from wherever it is, so retriggering a fading note doesn't click
+     */
+    void gate(struct SoundInfo * sound) {
+        struct EnvelopeState * env = &sound->envelope;
+        if (sound->playing && !env->gate) {
+            env->gate = true;
+            env->stage = STAGE_ATTACK;
+            env->framesLeft = 0;
+        } else if (!sound->playing && env->gate) {
+            env->gate = false;
+            if (env->stage != STAGE_OFF)
+                env->stage = STAGE_RELEASE;
+            env->framesLeft = 0;
+            sound->stopping = false;
+        }
+    }
+
+    /**
+     * works out the per tick coefficients again if the editor or the tick rate changed.
+     * called once per block
+     */
+    void refresh(int tickRate) {
+        bool changed = tickRate != _tickRate;
+        for (int i = 0; i < 4; i++) {
+            if (vals[i] != _cachedVals[i]) {
+                _cachedVals[i] = vals[i];
+                changed = true;
+            }
+        }
+        if (!changed)
+            return;
+        _tickRate = tickRate;
+        // the attack crosses full scale after about 1.6 time constants, the others
+        // are close enough to done after about 3
+        _attackCoefficient = coefficient(milliseconds(AMP_ATTACK), 105000);
+        _decayCoefficient = coefficient(milliseconds(AMP_DECAY), 3 << 16);
+        _releaseCoefficient = coefficient(milliseconds(AMP_RELEASE), 3 << 16);
+        _sustainLevel = (int)(((s64)FULL_SCALE * clampedVal(AMP_SUSTAIN)) / MOD_AMOUNT_MAX);
+    }
+
+    /**
+     * multiplies length samples of one key by its envelope and adds them into mix
+     */
+    void render(struct SoundInfo * sound, const int *voice, int *mix, int length) {
+        struct EnvelopeState * env = &sound->envelope;
+        while (length > 0) {
+            if (env->framesLeft == 0)
+                tick(env);
+            int frames = length < env->framesLeft ? length : env->framesLeft;
+            env->framesLeft -= frames;
+            length -= frames;
+            int gain = env->gain;
+            int step = env->step;
+            for (; frames; frames--) {
+                *mix++ += (*voice++ * gain) >> 15;
+                gain += step;
+            }
+            env->gain = gain;
+        }
+    }
+
+    /**
+     * @return the envelope times in milliseconds, for synths that hand the envelope off
+     *  to something else (like an sfz player)
+     */
+    int milliseconds(int val) { return AMP_MS_PER_STEP * clampedVal(val); }
+
+    /**
+     * @return the sustain level in percent
+     */
+    int sustainPercent() { return (100 * clampedVal(AMP_SUSTAIN)) / MOD_AMOUNT_MAX; }
+
+private:
+    static const int FULL_SCALE = MOD_ONE << ENVELOPE_EXTRA_BITS;
+
+    int _cachedVals[4];
+    int _tickRate;
+    int _attackCoefficient;
+    int _decayCoefficient;
+    int _releaseCoefficient;
+    int _sustainLevel;
+
+    void tick(struct EnvelopeState * env) {
+        switch (env->stage) {
+            case STAGE_ATTACK:
+                approach(env, FULL_SCALE + FULL_SCALE / 4, _attackCoefficient);
+                if (env->level >= FULL_SCALE) {
+                    env->level = FULL_SCALE;
+                    env->stage = STAGE_DECAY;
+                }
+                break;
+            case STAGE_DECAY:
+                approach(env, _sustainLevel, _decayCoefficient);
+                if (abs(env->level - _sustainLevel) < FULL_SCALE >> 10)
+                    env->stage = STAGE_SUSTAIN;
+                break;
+            case STAGE_SUSTAIN:
+                env->level = _sustainLevel;
+                break;
+            case STAGE_RELEASE:
+                // wait for the gain to finish ramping down before calling it done
+                if (env->level == 0 && env->gain == 0)
+                    env->stage = STAGE_OFF;
+                approach(env, -FULL_SCALE / 16, _releaseCoefficient);
+                if (env->level < 0)
+                    env->level = 0;
+                break;
+            default:
+                env->level = 0;
+        }
+
+        int target = env->level >> (MOD_SHIFT + ENVELOPE_EXTRA_BITS - 15);
+        env->step = (target - env->gain) >> CONTROL_SHIFT;
+        // the shift rounds towards minus infinity, so land exactly on the target
+        env->gain = target - env->step * CONTROL_PERIOD;
+        env->framesLeft = CONTROL_PERIOD;
+    }
+
+    void approach(struct EnvelopeState * env, int target, int coefficient) {
+        env->level += (int)(((s64)(target - env->level) * coefficient) >> 16);
+    }
+
+    /**
+     * @param timeConstants how many time constants the segment should take, out of 1 << 16
+     * @return how much of the way to its target a segment goes per tick, out of 1 << 16
+     */
+    int coefficient(int milliseconds, int timeConstants) {
+        int ticks = (milliseconds * _tickRate) / 1000;
+        if (ticks <= 1)
+            return 1 << 16;
+        int c = timeConstants / ticks;
+        return c > (1 << 16) ? 1 << 16 : c;
+    }
+
+    int clampedVal(int i) {
+        if (vals[i] < 0)
+            return 0;
+        if (vals[i] > MOD_AMOUNT_MAX)
+            return MOD_AMOUNT_MAX;
+        return vals[i];
+    }
+};
+
+AmpEnvelope ampEnvelope;
+
+/**
+ * A stand-in for a slow flashcart, so the export's I/O pattern can be timed the same way
+ * every time without depending on whichever card is in the DS. It charges each file
+ * operation what the CARD_* costs say it takes: a fixed cost per open, plus a search
+ * through every file already in the directory; a fixed cost per write, plus the bytes
+ * at the card's speed, plus a FAT update whenever the file grows into a new cluster;
+ * and a fixed cost per close. The costs are made up to be about as slow as a cheap
+ * flashcart, so change them to match a card you have timed.
+ *
+ * It assumes every file the export opens is new and they all go in the one directory,
+ * which is what the export does to an empty sfz folder.
+ */
+class CardModel {
+public:
+    CardModel() { reset(); }
+
+    void reset() {
+        _files = 0;
+        _writes = 0;
+        _fileBytes = 0;
+        _microseconds = 0;
+    }
+
+    void open() {
+        _microseconds += CARD_OPEN_US + (u64)_files * CARD_ENTRY_US;
+        _files++;
+        _fileBytes = 0;
+    }
+
+    void write(int bytes) {
+        int clusters = (_fileBytes + bytes + CARD_CLUSTER_BYTES - 1) / CARD_CLUSTER_BYTES
+            - (_fileBytes + CARD_CLUSTER_BYTES - 1) / CARD_CLUSTER_BYTES;
+        _microseconds += CARD_WRITE_US
+            + ((u64)bytes * 1000000) / (CARD_KB_PER_SECOND * 1024)
+            + (u64)clusters * CARD_CLUSTER_US;
+        _fileBytes += bytes;
+        _writes++;
+    }
+
+    void close() { _microseconds += CARD_CLOSE_US; }
+
+    u64 ticks() { return (_microseconds * BUS_CLOCK) / 1000000; }
+    int files() { return _files; }
+    int writes() { return _writes; }
+
+private:
+    int _files;
+    int _writes;
+    int _fileBytes; // in the file that's open
+    u64 _microseconds;
+};
+
+/**
+ * Collects the many tiny writes of an export (two bytes per sample) into one block
+ * and hands it to libfat in sector sized chunks. stdio buffering is turned off
+ * so that every fwrite goes straight to whole sectors of the file instead of
+ * being copied a second time.
+ *
+ * It also keeps track of how long was spent waiting on the SD card so that the
+ * export can tell rendering time and I/O time apart. Everything it does is also
+ * handed to a CardModel. With CARD_MODEL on, that's all that happens, nothing is
+ * written to the card, and the I/O time is the model's.
+ */
+class BufferedFile {
+public:
+    BufferedFile() : _file{NULL}, _isOpen{false}, _used{0}, _ioTicks{0} {}
+
+    bool open(const char *name, const char *mode) {
+        u32 start = Clock::now();
+#if CARD_MODEL
+        _isOpen = true;
+#else
+        _file = fopen(name, mode);
+        if (_file != NULL)
+            setvbuf(_file, NULL, _IONBF, 0);
+        _isOpen = _file != NULL;
+#endif
+        if (_isOpen)
+            _card.open();
+        _used = 0;
+        _ioTicks += Clock::now() - start;
+        return _isOpen;
+    }
+
+    void write(const void *data, int size) {
+        const u8 *bytes = (const u8 *)data;
+        while (size > 0) {
+            int chunk = EXPORT_BUFFER_SIZE - _used;
+            if (chunk > size)
+                chunk = size;
+            memcpy(_buffer + _used, bytes, chunk);
+            _used += chunk;
+            bytes += chunk;
+            size -= chunk;
+            if (_used == EXPORT_BUFFER_SIZE)
+                flush();
+        }
+    }
+
+    void close() {
+        if (!_isOpen)
+            return;
+        flush();
+        u32 start = Clock::now();
+#if !CARD_MODEL
+        fclose(_file);
+        _file = NULL;
+#endif
+        _isOpen = false;
+        _card.close();
+        _ioTicks += Clock::now() - start;
+    }
+
+    /**
+     * @return the time spent on the card, or with CARD_MODEL on the time the model says
+     *  it would have taken
+     */
+    u64 ioTicks() { return CARD_MODEL ? _card.ticks() : _ioTicks; }
+    void resetIoTicks() {
+        _ioTicks = 0;
+        _card.reset();
+    }
+    CardModel &card() { return _card; }
+
+private:
+    FILE *_file;
+    bool _isOpen;
+    int _used;
+    u64 _ioTicks;
+    CardModel _card;
+    u8 _buffer[EXPORT_BUFFER_SIZE];
+
+    void flush() {
+        if (_used == 0)
+            return;
+        u32 start = Clock::now();
+#if !CARD_MODEL
+        fwrite(_buffer, 1, _used, _file);
+#endif
+        _card.write(_used);
+        _used = 0;
+        _ioTicks += Clock::now() - start;
+    }
+};
+
+BufferedFile exportFile;
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The overlay
+ * Only one synth plays at a time, so only one synth needs its voices at a time. Rather
+ * than every synth keeping 13 voices' worth of state (and its big tables) for as long
+ * as the app runs, there's one block of memory the synth that's switched to takes all
+ * of that out of, in its attach method. Switching synths starts the overlay over, so
+ * whatever the last synth had in it is gone, and the new synth sets up everything it
+ * takes from scratch. The editors' values, and anything else small that a synth needs
+ * to remember while it isn't playing, stay in the synth itself.
+ *
+ * Only put things in the overlay that can be rebuilt from the editors. onPatchChange is
+ * called right after attach, so tables that it builds are fine.
+ *
+ * Every synth that takes from the overlay adds up what its attach takes in a static
+ * overlayBytes(), using bytesFor, and the static_asserts after the synths check that
+ * it fits in OVERLAY_SIZE. If you take something new in attach, add it there too.
+ */
+class Overlay {
+public:
+    Overlay() : _used{0} {}
+
+    /**
+     * forgets everything that's been taken, for the next synth
+     */
+    void reset() { _used = 0; }
+
+    /**
+     * @return count default constructed Ts, starting on an OVERLAY_ALIGN boundary
+     */
+    template <typename T>
+    T *take(int count) {
+        T *items = (T *)&_memory[_used];
+        _used += bytesFor<T>(count);
+        sassert(_used <= OVERLAY_SIZE, "overlay is full.\nraise OVERLAY_SIZE");
+        for (int i = 0; i < count; i++)
+            new (&items[i]) T();
+        return items;
+    }
+
+    /**
+     * @return how many bytes the synth that's attached has taken
+     */
+    int used() { return _used; }
+
+    /**
+     * @return the room take(count) would use up, for checking a synth fits at compile time
+     */
+    template <typename T>
+    static constexpr int bytesFor(int count) {
+        return (count * sizeof(T) + OVERLAY_ALIGN - 1) & ~(OVERLAY_ALIGN - 1);
+    }
+
+private:
+    u8 _memory[OVERLAY_SIZE] __attribute__((aligned(OVERLAY_ALIGN)));
+    int _used;
 };
 
+Overlay overlay;
+
 /**
  * NOTE TO FUTURE PROGRAMMERS - How to make your very own synth!
  * 
@@ -831,10 +2251,15 @@ private:
  * Super Mario Bros using the piano keys.
  * 
  * Here are some words of advice.
- * 1. The application feeds the output of "s16 frameOutput()" directly to the audio
- *    stream without any interferance. "s16 frameOutput()" only adds up the output of
- *    "s16 getOutputSample(struct SoundInfo * sound)" for each key. You implement this
- *    method. You don't need to worry about anything messing with your audio but you.
+ * 1. The application feeds the output of "void renderBlock(s16 *dest, int length)" directly
+ *    to the audio stream without any interferance. By default "renderBlock" only adds up
+ *    the output of "s16 getOutputSample(struct SoundInfo * sound)" for each key, after
+ *    putting it through the shared amplitude envelope. You implement this method. You
+ *    don't need to worry about anything messing with your audio but you and the
+ *    envelope. Keep making sound for as long as ampEnvelope.sounding() says the key is
+ *    sounding, which is a while after it's let go of. If your synth has work that doesn't
+ *    need to happen every sample, override "renderSound" instead and give it a control
+ *    tick (see the note about control rate).
  * 2. This is 16 bit signed audio. If you're output is too loud, it'll overflow
  *    and your ears may not like it (or you could do it intentionally because
  *    you're into that kind of thing). Make sure that your output is quiet enough
@@ -857,12 +2282,15 @@ public:
         _sfzExportAvailable{sfzExportAvailable}
     {}
 
-    virtual s16 frameOutput() {
-        s16 output = 0;
-        for (int i = 0; i < 13; i++) {
-            output += getOutputSample(&sounds[i]);
-        }
-        return output;
+    /**
+     * fills dest with the next length samples of the synth
+     *
+     * @param length must be no more than MIX_BLOCK
+     */
+    virtual void renderBlock(s16 *dest, int length) {
+        mixVoices(length);
+        for (int i = 0; i < length; i++)
+            dest[i] = mixBuffer[i];
     }
 
     void mmChangeSettings() {
@@ -875,6 +2303,78 @@ public:
         return wavExport.exporting;
     }
 
+    int getSamplingRate() { return _samplingRate; }
+
+    /**
+     * called from the main loop (never the audio stream) when an editor changed a value,
+     * and when switching to this synth. rebuild anything derived from the editors here
+     */
+    virtual void onPatchChange() {}
+
+    /**
+     * called from the main loop for a key that's just been pressed, before the audio
+     * stream gets to it. slow note on work (filling bursts and tables) belongs here, so
+     * the justPressed branch in the audio code only has to pick up what was left ready.
+     * the audio code still prepares a note itself if this didn't get to it first
+     */
+    virtual void prepareNote(struct SoundInfo * sound) {}
+
+    void prepareNotes() {
+        for (int i = 0; i < 13; i++)
+            if (sounds[i].justPressed && sounds[i].playing)
+                prepareNote(&sounds[i]);
+    }
+
+    /**
+     * called once per main loop. synths can spread slow work (like rebuilding tables
+     * after onPatchChange) over several frames here. finishBackgroundWork does whatever
+     * is left right away, and is called before anything that needs it done (exporting)
+     */
+    virtual void doBackgroundWork() {}
+    virtual void finishBackgroundWork() {}
+
+    /**
+     * called when switching to this synth, just before onPatchChange. take the voices,
+     * and any big tables that onPatchChange rebuilds, out of the overlay here and set
+     * them up from scratch. see the note above Overlay
+     */
+    virtual void attach(Overlay &overlay) {}
+
+    /**
+     * for the benchmark. how many bytes of the overlay the synth takes for each voice, and
+     * how many it keeps for itself whichever synth is playing
+     */
+    virtual int bytesPerVoice() { return 0; }
+    virtual int residentBytes() { return sizeof(Synth); }
+
+    /**
+     * for the benchmark. how many unison copies each voice plays. synths without
+     * unison always play one, and ignore setUnisonCopies
+     */
+    virtual int getUnisonCopies() { return 1; }
+    virtual void setUnisonCopies(int copies) {}
+
+    /**
+     * for the benchmark. how many oscillators each voice runs, for synths built out of
+     * operators. everything else says 0
+     */
+    virtual int getOperatorCount() { return 0; }
+
+    /**
+     * for the benchmark. log2 of how many times faster than its output the synth
+     * renders. synths that can't oversample say -1 and ignore setOversampling
+     */
+    virtual int getOversampling() { return -1; }
+    virtual void setOversampling(int shift) {}
+
+    /**
+     * for the benchmark. swaps in a patch that should only make the harmonics of the note,
+     * so whatever else comes out is aliasing, or puts the player's patch back
+     *
+     * @return whether the synth has a test patch
+     */
+    virtual bool useTestPatch(bool on) { return false; }
+
     struct wav_header {
         char riff[4];
         int32_t flength;
@@ -891,9 +2391,7 @@ public:
         int32_t dlength;
     };
 
-    void exportSingleSample(FILE * sampleFile, int freq) {
-        //printf("exporting sample... ");
-        
+    void exportSingleSample(BufferedFile &sampleFile, int freq) {
         struct wav_header wavh;
         strncpy(wavh.riff, "RIFF", 4);
         strncpy(wavh.wave, "WAVE", 4);
@@ -910,13 +2408,15 @@ public:
         wavh.dlength = 0;
         wavh.flength = 0;
 
-        
         wavExport.exporting = true;
-        
+
         struct SoundInfo sampleInfo;
+        sampleInfo.key = 0;
         sampleInfo.playing = true;
+        sampleInfo.stopping = false;
         sampleInfo.freq = freq;
         sampleInfo.phaseFramesElapsed = 0;
+        sampleInfo.envelope.stage = AmpEnvelope::STAGE_OFF;
         sampleInfo.justPressed = true;
         while (wavExport.exporting) { // first we need to find out how long the sample is going to be
             getOutputSample(&sampleInfo);
@@ -925,10 +2425,10 @@ public:
         wavh.dlength = (wavExport.exportFramesElapsed + 1) * wavh.bytes_per_sample;
         wavh.flength = wavh.dlength + 44;
 
-        fwrite(&wavh, sizeof(wavh), 1, sampleFile);
+        // the header goes through the same buffer as the samples so that every write
+        // after it still lands on a sector boundary
+        sampleFile.write(&wavh, sizeof(wavh));
 
-        //fseek(sampleFile, 45, SEEK_SET);
-        //struct SoundInfo sampleInfo;
         sampleInfo.playing = true;
         sampleInfo.freq = freq;
         sampleInfo.phaseFramesElapsed = 0;
@@ -936,15 +2436,8 @@ public:
         wavExport.exporting = true;
         while (wavExport.exporting) {
             s16 output = getOutputSample(&sampleInfo);
-            fwrite(&output, sizeof(output), 1, sampleFile);
+            sampleFile.write(&output, sizeof(output));
         }
-
-        /*
-        wavh.dlength = (wavExport.exportFramesElapsed + 1) * wavh.bytes_per_sample;
-        wavh.flength = wavh.dlength + 44;
-        fseek(sampleFile, 0, SEEK_SET);
-        fwrite(&wavh, sizeof(wavh), 1, sampleFile);
-        */
     }
 
     /**
@@ -959,82 +2452,319 @@ public:
      * 1. increment wavExport.exportFramesElapsed every frame
      * 2. set wavExport.exporting to false to finish sampling (otherwise it will infinitely loop)
      * 3. set wavExport.loopStart and wavExport.loopEnd to the frames you will to loop around
+     *
+     * The region lines of the sfz file are collected in memory and written once at the
+     * end, so the card only sees one file creation per wav plus one for the sfz.
+     *
+     * The wavs are exported without the amplitude envelope. Its settings go in the sfz
+     * as ampeg opcodes instead, so the sampler plays the envelope and the loops stay clean.
      */
     void exportSFZ() {
-        pc->cursorX = 0;
-        pc->cursorY = 20;
+        text.moveTo(0, 20);
         if (!_sfzExportAvailable) {
-            printf("sfz export not available\n for this synth");
+            text.print("sfz export not available\n for this synth");
             return;
         }
-        printf("exporting");
-        FILE* sfz = fopen("sfz/export.sfz", "w");
-        char global_parameters[] = "<global> loop_mode=loop_continuous\n\n";
-        fwrite(global_parameters, sizeof(char), strlen(global_parameters), sfz);
-        fclose(sfz);
+        text.print("exporting");
+        text.present();
+        finishBackgroundWork();
+
+        // an export can take longer than the clock takes to wrap, so it's timed a note
+        // at a time
+        u32 lapStart = Clock::now();
+        u64 exportTicks = 0;
+        exportFile.resetIoTicks();
+
+        int sfzLength = sprintf(
+            sfzText,
+            "<global> loop_mode=loop_continuous ampeg_attack=%d.%03d ampeg_decay=%d.%03d ampeg_sustain=%d ampeg_release=%d.%03d\n\n",
+            ampEnvelope.milliseconds(AMP_ATTACK) / 1000, ampEnvelope.milliseconds(AMP_ATTACK) % 1000,
+            ampEnvelope.milliseconds(AMP_DECAY) / 1000, ampEnvelope.milliseconds(AMP_DECAY) % 1000,
+            ampEnvelope.sustainPercent(),
+            ampEnvelope.milliseconds(AMP_RELEASE) / 1000, ampEnvelope.milliseconds(AMP_RELEASE) % 1000
+        );
 
         MidiInfo midi = MidiInfo();
         for (int midi_index = 0; midi_index < 128; midi_index++) {
             char file_name[64];
             sprintf(file_name, "sfz/%s.wav", midi.info[midi_index].name);
-            FILE* sample = fopen(file_name, "w+");
-
-            exportSingleSample(sample, midi.info[midi_index].pitch);
-
-            //printf("past export sample");
-
-            fclose(sample);
-
-            sprintf(file_name, "%s.wav", midi.info[midi_index].name);
+            if (exportFile.open(file_name, "wb")) {
+                exportSingleSample(exportFile, midi.info[midi_index].pitch);
+                exportFile.close();
+            }
 
-            char sfz_region_data[128];
-            sprintf(
-                sfz_region_data,
-                "<region> sample=%s key=%d loop_start=%d loop_end=%d\n\n",
-                file_name,
+            sfzLength += sprintf(
+                sfzText + sfzLength,
+                "<region> sample=%s.wav key=%d loop_start=%d loop_end=%d\n\n",
+                midi.info[midi_index].name,
                 midi.info[midi_index].midi_key_number,
                 wavExport.loopStart,
                 wavExport.loopEnd
             );
-            sfz = fopen("sfz/export.sfz", "a");
-            fwrite(sfz_region_data, sizeof(char), strlen(sfz_region_data), sfz);
-            fclose(sfz);
 
-            pc->cursorX = Lerp::lerp(0, PRINT_WIDTH, midi_index, 128);
-            pc->cursorY = 21;
-            printf("|");
-        }
+            // the main loop is stuck here until the export is done, so the bar goes on
+            // the screen right away
+            text.moveTo(Lerp::lerp(0, PRINT_WIDTH, midi_index, 128), 21);
+            text.print("|");
+            text.present();
+            exportTicks += Clock::lap(lapStart);
+        }
+
+        if (exportFile.open("sfz/export.sfz", "wb")) {
+            exportFile.write(sfzText, sfzLength);
+            exportFile.close();
+        }
+
+        exportTicks += Clock::lap(lapStart);
+#if CARD_MODEL
+        // the model's time wasn't really spent, so it's added on
+        exportTicks += exportFile.ioTicks();
+        text.moveTo(0, 21);
+        text.format("model: %d files %d writes      ", exportFile.card().files(), exportFile.card().writes());
+#endif
+        int totalMs = Clock::ticksToMilliseconds(exportTicks);
+        int ioMs = Clock::ticksToMilliseconds(exportFile.ioTicks());
+        text.moveTo(0, 20);
+        text.format("done %d.%ds (sd %d.%ds)        ", totalMs / 1000, (totalMs / 100) % 10, ioMs / 1000, (ioMs / 100) % 10);
+    }
+    
+protected:
+    int _gain;
+    int _samplingRate;
+    bool _sfzExportAvailable;
+    
+    struct exportFrameData {
+        bool exporting; // while exporting is true, continue retrieving samples
+        int exportFramesElapsed; // the frame of the export we are on
+        int loopStart; // the sample at which the looping portion starts
+        int loopEnd; // the sample at which the looping portion ends
+    };
+
+    struct exportFrameData wavExport;
+
+    static char sfzText[SFZ_TEXT_SIZE];
+    static int mixBuffer[MIX_BLOCK];
+    static int voiceBuffer[MIX_BLOCK];
+
+    /**
+     * fills mixBuffer with length samples of every key that's sounding, each one put
+     * through its amplitude envelope. keys that have finished fading out are skipped
+     */
+    void mixVoices(int length) {
+        for (int i = 0; i < length; i++)
+            mixBuffer[i] = 0;
+        ampEnvelope.refresh(controlRate());
+        for (int i = 0; i < 13; i++) {
+            struct SoundInfo * sound = &sounds[i];
+            ampEnvelope.gate(sound);
+            if (!ampEnvelope.sounding(sound))
+                continue;
+            for (int j = 0; j < length; j++)
+                voiceBuffer[j] = 0;
+            renderSound(sound, voiceBuffer, length);
+            ampEnvelope.render(sound, voiceBuffer, mixBuffer, length);
+        }
+    }
+    
+    virtual s16 getOutputSample(struct SoundInfo * sound) = 0;
+
+    /**
+     * adds length samples of one key into mix
+     */
+    virtual void renderSound(struct SoundInfo * sound, int *mix, int length) {
+        for (int i = 0; i < length; i++)
+            mix[i] += getOutputSample(sound);
+    }
+
+    /**
+     * @return how many samples per second renderSound makes. synths that oversample
+     *  render faster than they play
+     */
+    virtual int renderRate() { return _samplingRate; }
+
+    /**
+     * @return how many control ticks happen per second at this synth's render rate
+     */
+    int controlRate() { return renderRate() >> CONTROL_SHIFT; }
+};
+
+char Synth::sfzText[SFZ_TEXT_SIZE];
+int Synth::mixBuffer[MIX_BLOCK];
+int Synth::voiceBuffer[MIX_BLOCK];
+
+class EmptySynth : public Synth {
+public:
+    EmptySynth(int gain, int sampleRate) : Synth(gain, sampleRate, false) {}
+
+    int residentBytes() override { return sizeof(EmptySynth); }
+private:
+    s16 getOutputSample(struct SoundInfo * sound) {
+        return ampEnvelope.sounding(sound)?(((sound->phaseFramesElapsed++%(_samplingRate/sound->freq))>_samplingRate/(2*sound->freq))?_gain:-_gain):0;
+    }
+};
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The delay pool
+ * The string synths need a delay line one period of the note long for each key. Rather
+ * than every synth keeping the longest line any note could need for all 13 keys, there's
+ * one pool of 16 bit samples, and a key takes a line out of it sized to the note when
+ * it's pressed. Lines are a power of two long so the synths can wrap around them with a
+ * mask. Each key holds at most one line, whichever synth is playing it, and pressing the
+ * key again gives it back before taking a new one.
+ *
+ * Every line starts at a multiple of its own length, so two lines never straddle the
+ * same 1 << DELAY_MAX_BITS stretch of the pool unless one holds the other. With 13 keys
+ * that means 13 of those stretches are the most that can be in use, and the pool has
+ * room for 16, so taking a line never fails.
+ *
+ * The samples come out of the overlay, so the pool only holds anything while a string
+ * synth is attached. Attaching gives every line back.
+ */
+class DelayPool {
+public:
+    struct line {
+        s16 *samples;
+        int mask;
+    };
+
+    DelayPool() : _samples {NULL}, _used {} {
+        for (int i = 0; i < 13; i++) {
+            _lines[i].samples = NULL;
+            _lines[i].mask = 0;
+            _blocks[i] = 0;
+        }
+    }
+
+    /**
+     * takes the samples from the overlay, with every line given back
+     */
+    static constexpr int overlayBytes() { return Overlay::bytesFor<s16>(DELAY_POOL_LENGTH); }
+
+    void attach(Overlay &overlay) {
+        _samples = overlay.take<s16>(DELAY_POOL_LENGTH);
+        for (int i = 0; i < NUM_BLOCKS; i++)
+            _used[i] = false;
+        for (int i = 0; i < 13; i++) {
+            _lines[i].samples = _samples;
+            _lines[i].mask = 0;
+            _blocks[i] = 0;
+        }
+    }
+
+    /**
+     * gives a key a new delay line, in place of the one it had
+     *
+     * @param length how many samples the line needs to hold. lines longer than
+     *  1 << DELAY_MAX_BITS get that many
+     */
+    struct line *take(int key, int length) {
+        giveBack(key);
+        int bits = DELAY_BLOCK_BITS;
+        while ((1 << bits) < length && bits < DELAY_MAX_BITS)
+            bits++;
+        int blocks = 1 << (bits - DELAY_BLOCK_BITS);
+        for (int start = 0; start < NUM_BLOCKS; start += blocks) {
+            if (isFree(start, blocks)) {
+                for (int i = 0; i < blocks; i++)
+                    _used[start + i] = true;
+                _starts[key] = start;
+                _blocks[key] = blocks;
+                _lines[key].samples = &_samples[start << DELAY_BLOCK_BITS];
+                _lines[key].mask = (1 << bits) - 1;
+                break;
+            }
+        }
+        return &_lines[key];
+    }
+
+    /**
+     * the line a key has now. before the key has ever taken one it's a single sample,
+     * so a synth can always read from it
+     */
+    struct line *lineFor(int key) { return &_lines[key]; }
+
+private:
+    static const int NUM_BLOCKS = DELAY_POOL_LENGTH >> DELAY_BLOCK_BITS;
+
+    s16 *_samples;
+    bool _used[NUM_BLOCKS];
+    struct line _lines[13];
+    int _starts[13];
+    int _blocks[13];
+
+    void giveBack(int key) {
+        for (int i = 0; i < _blocks[key]; i++)
+            _used[_starts[key] + i] = false;
+        _blocks[key] = 0;
+    }
+
+    bool isFree(int start, int blocks) {
+        for (int i = 0; i < blocks; i++)
+            if (_used[start + i])
+                return false;
+        return true;
+    }
+};
+
+DelayPool delayPool;
+
+/**
+ * A first order all pass filter for the feedback loop of a string synth. A delay line can
+ * only be a whole number of samples long, so on high notes the loop's length, and so its
+ * pitch, is way off. The all pass lets everything through at the same volume but delays
+ * it by a fraction of a sample, which makes up the difference. It costs one multiply per
+ * sample, and the coefficient is only worked out when a key is pressed.
+ */
+class FractionalDelay {
+public:
+    FractionalDelay() : _input {0}, _output {0}, _coefficient {0} {}
+
+    /**
+     * sets the filter up for a note and forgets the last one
+     *
+     * @param loopDelay how many samples the rest of the loop delays by, out of 65536. a
+     *  two tap average adds half a sample, see onePoleDelay for the one pole kind
+     * @return how long the delay line should be
+     */
+    int tune(int samplingRate, int freq, int loopDelay) {
+        int period = ((u64)samplingRate << 16) / freq;
+        // the all pass is best behaved delaying by between 0.1 and 1.1 samples
+        int length = (period - loopDelay - 6554) >> 16;
+        if (length < 1)
+            length = 1;
+        int delay = period - loopDelay - (length << 16);
+        if (delay < 6554)
+            delay = 6554;
+        _coefficient = ((s64)(65536 - delay) << 15) / (65536 + delay);
+        _input = 0;
+        _output = 0;
+        return length;
+    }
 
-        fclose(sfz);
-        pc->cursorX = 0;
-        pc->cursorY = 20;
-        printf("done                ");
+    /**
+     * the delay of y = (x + y') / 2 at the note's frequency, out of 65536 samples. unlike a
+     * two tap average it isn't the same at every frequency: a whole sample down low and
+     * less the higher the note. it's atan(sin w / (2 - cos w)) / w
+     */
+    static int onePoleDelay(int samplingRate, int freq) {
+        u32 phase = ((u64)freq << 32) / samplingRate; // w, a whole circle is 1 << 32
+        int x = 2 * 32767 - sineTable.lookup(phase + (1u << 30));
+        int y = sineTable.lookup(phase);
+        int magnitude, angle;
+        Fft::toPolar(x << 8, y << 8, magnitude, angle);
+        return ((u64)angle << 32) / phase;
     }
-    
-protected:
-    int _gain;
-    int _samplingRate;
-    bool _sfzExportAvailable;
-    
-    struct exportFrameData {
-        bool exporting; // while exporting is true, continue retrieving samples
-        int exportFramesElapsed; // the frame of the export we are on
-        int loopStart; // the sample at which the looping portion starts
-        int loopEnd; // the sample at which the looping portion ends
-    };
 
-    struct exportFrameData wavExport;
-    
-    virtual s16 getOutputSample(struct SoundInfo * sound) = 0;
-};
+    int process(int input) {
+        _output = ((_coefficient * (input - _output)) >> 15) + _input;
+        _input = input;
+        return _output;
+    }
 
-class EmptySynth : public Synth {
-public:
-    EmptySynth(int gain, int sampleRate) : Synth(gain, sampleRate, false) {}
 private:
-    s16 getOutputSample(struct SoundInfo * sound) {
-        return sound->playing?(((sound->phaseFramesElapsed++%(_samplingRate/sound->freq))>_samplingRate/(2*sound->freq))?_gain:-_gain):0;
-    }
+    int _input;
+    int _output;
+    int _coefficient; // out of 32768
 };
 
 /*class VariableLengthWavetable : public Synth {
@@ -1054,55 +2784,105 @@ public:
     Synth(gain, samplingRate, false),
     _table(table),
     _slider1Val(slider1Val),
-    _switchVal(switchVal) {}
+    _switchVal(switchVal),
+    _excitement(slider1Val, TABLE_LENGTH - 1),
+    infos {NULL} {}
+
+    /**
+     * takes the delay pool, and the voices after it
+     */
+    static constexpr int overlayBytes() { return DelayPool::overlayBytes() + Overlay::bytesFor<struct ESInfo>(13); }
+
+    void attach(Overlay &overlay) override {
+        delayPool.attach(overlay);
+        infos = overlay.take<struct ESInfo>(13);
+        for (int i = 0; i < 13; i++) {
+            infos[i].noise.seed(Random::seedFor(i));
+            infos[i].preparedFreq = 0;
+            infos[i].previous = 0;
+            infos[i].length = 1;
+            infos[i].position = 0;
+            infos[i].line = delayPool.lineFor(i);
+        }
+    }
+
+    int bytesPerVoice() override { return sizeof(struct ESInfo); }
+
+    /**
+     * a prepared note was made from the editors as they were, so it's made again
+     */
+    void onPatchChange() override {
+        for (int i = 0; i < 13; i++)
+            infos[i].preparedFreq = 0;
+    }
 
     void exportSFZ() {}
-private:
-    Random randy;
 
+    /**
+     * takes a delay line for the key and fills it with the burst
+     */
+    void prepareNote(struct SoundInfo * sound) override {
+        struct ESInfo * info = &infos[sound->key];
+        if (info->preparedFreq == sound->freq)
+            return;
+        // the loop filter here is a one pole, not PluckedString's two tap average
+        info->length = info->tuning.tune(_samplingRate, sound->freq, FractionalDelay::onePoleDelay(_samplingRate, sound->freq));
+        info->line = delayPool.take(sound->key, info->length);
+        if (info->length > info->line->mask + 1)
+            info->length = info->line->mask + 1;
+        switch (_switchVal) {
+            case 0: { // fill the burst table with random
+                info->noise.randArray(info->line->samples, info->length, TABLE_MAX);
+                break;
+            }
+            case 1: { // fill the burst table with a squeezed rendition of the _table (filled by a table editor)
+                for (int i = 0; i < info->length; i++) {
+                    info->line->samples[i] = _table[Lerp::lerp(0, TABLE_LENGTH - 1, i, info->length - 1)];
+                }
+                break;
+            }
+        }
+        info->position = info->length;
+        info->previous = info->line->samples[info->length - 1];
+        info->preparedFreq = sound->freq;
+    }
+private:
     s16 (&_table)[TABLE_LENGTH];
     int &_slider1Val;
     int &_switchVal;
+    Probability _excitement;
 
     struct ESInfo {
+        Random noise;
+        int preparedFreq; // what prepareNote set a pressed but unplayed key up for. 0 if nothing
         s16 previous;
         int length;
-        s16 table[3000];
+        int position; // where the next sample is written. the sample length before it is read
+        struct DelayPool::line *line;
+        FractionalDelay tuning;
     };
-    struct ESInfo infos[13];
+    struct ESInfo *infos; // in the overlay
 
     s16 getOutputSample(struct SoundInfo * sound) {
         struct ESInfo * info = &infos[sound->key];
-        if (sound->playing) {
-            info->length = _samplingRate / sound->freq;
+        if (ampEnvelope.sounding(sound)) {
             if (sound->justPressed) {
-                switch (_switchVal) {
-                    case 0: { // fill the burst table with random
-                        for (int i = 0; i < info->length; i++) {
-                           info->table[i] = rand() % TABLE_MAX;
-                        }
-                        break;
-                    }
-                    case 1: { // fill the burst table with a squeezed rendition of the _table (filled by a table editor)
-                        for (int i = 0; i < info->length; i++) {
-                            info->table[i] = _table[Lerp::lerp(0, TABLE_LENGTH - 1, i, info->length - 1)];
-                        }
-                        break;
-                    }
-                }
-                info->previous = info->table[info->length];
+                if (info->preparedFreq != sound->freq)
+                    prepareNote(sound);
+                info->preparedFreq = 0;
                 sound->justPressed = false;
             }
+            s16 *samples = info->line->samples;
+            int mask = info->line->mask;
+            s16 current = samples[(info->position - info->length) & mask];
             s16 output;
-            if (randy.prob(_slider1Val, TABLE_LENGTH - 1)) {
-                output = info->table[sound->phaseFramesElapsed] += randy.coinFlip() ? 16 : -16;
+            if (info->noise.chance(_excitement.threshold())) {
+                output = current + (info->noise.coinFlip() ? 16 : -16);
             } else {
-                output = info->previous =
-                    info->table[sound->phaseFramesElapsed] =
-                    (info->table[sound->phaseFramesElapsed] + info->previous) >> 1;
+                output = info->previous = (current + info->previous) >> 1;
             }
-            sound->phaseFramesElapsed++;
-            sound->phaseFramesElapsed %= info->length;
+            output = info->tuning.process(output);
+            samples[info->position++ & mask] = output;
             return _gain * output;
         } else {
             return 0;
@@ -1117,22 +2897,68 @@ public:
     Synth(gain, samplingRate, false),
     _table(table),
     _slider1Val(slider1Val),
-    _switchVal(switchVal) {}
+    _switchVal(switchVal),
+    _swapChance(slider1Val, TABLE_LENGTH - 1),
+    bubbles {NULL} {}
+
+    static constexpr int overlayBytes() { return Overlay::bytesFor<struct bubbleInfo>(13); }
+
+    void attach(Overlay &overlay) override {
+        bubbles = overlay.take<struct bubbleInfo>(13);
+        for (int i = 0; i < 13; i++) {
+            bubbles[i].noise.seed(Random::seedFor(i));
+            bubbles[i].preparedFreq = 0;
+        }
+    }
+
+    int bytesPerVoice() override { return sizeof(struct bubbleInfo); }
+
+    /**
+     * a prepared note was made from the editors as they were, so it's made again
+     */
+    void onPatchChange() override {
+        for (int i = 0; i < 13; i++)
+            bubbles[i].preparedFreq = 0;
+    }
 
     void exportSFZ() {}
+
+    /**
+     * fills the key's table to be sorted
+     */
+    void prepareNote(struct SoundInfo * sound) override {
+        struct bubbleInfo *bubble = &bubbles[sound->key];
+        if (bubble->preparedFreq == sound->freq)
+            return;
+        switch (_switchVal) {
+            case 0:  { // fill random
+                bubble->noise.randArray(bubble->table, TABLE_LENGTH, TABLE_MAX);
+                break;
+            }
+            case 1: { // fill with table editor
+                for (int i = 0; i < TABLE_LENGTH; i++) {
+                    bubble->table[i] = _table[i];
+                }
+                break;
+            }   
+        }
+        bubble->previousPhase = 0;
+        bubble->preparedFreq = sound->freq;
+    }
 private:
     s16 (&_table)[TABLE_LENGTH];
     int &_slider1Val; // used for probabalistic stretching
     int &_switchVal; // fill the table with random burst or user drawn table
-    
-    Random randy;
+    Probability _swapChance;
 
     struct bubbleInfo {
+        Random noise;
+        int preparedFreq; // what prepareNote set a pressed but unplayed key up for. 0 if nothing
         int previousPhase;
         s16 table[TABLE_LENGTH];
     };
 
-   struct bubbleInfo bubbles[13];
+    struct bubbleInfo *bubbles; // in the overlay
 
     int getWavePhase(struct SoundInfo * sound) {
         int phase = div32((sound->phaseFramesElapsed * sound->freq * TABLE_LENGTH), _samplingRate);
@@ -1147,29 +2973,19 @@ private:
     }
 
     s16 getOutputSample(struct SoundInfo * sound) {
-        if (sound->playing) {
+        if (ampEnvelope.sounding(sound)) {
             struct bubbleInfo *bubble = &bubbles[sound->key];
             if (sound->justPressed) {
-                switch (_switchVal) {
-                    case 0:  { // fill random
-                        randy.randArray(bubble->table, TABLE_LENGTH, TABLE_MAX);
-                        break;
-                    }
-                    case 1: { // fill with table editor
-                        for (int i = 0; i < TABLE_LENGTH; i++) {
-                            bubble->table[i] = _table[i];
-                        }
-                        break;
-                    }   
-                }
+                if (bubble->preparedFreq != sound->freq)
+                    prepareNote(sound);
+                bubble->preparedFreq = 0;
                 sound->justPressed = false;
-                bubble->previousPhase = 0;
             }
 
             int phase = getWavePhase(sound);
             s16 previous = bubble->table[bubble->previousPhase];
             s16 current = bubble->table[phase];
-            if (bubble->previousPhase < phase && previous > current && randy.prob(_slider1Val, TABLE_LENGTH - 1)) {
+            if (bubble->previousPhase < phase && previous > current && bubble->noise.chance(_swapChance.threshold())) {
                 bubble->table[bubble->previousPhase] = current;
                 bubble->table[phase] = previous;
             }
@@ -1190,22 +3006,65 @@ public:
     Synth(gain, samplingRate, false),
     _table(table),
     _slider1Val(slider1Val),
-    _switchVal(switchVal) {}
+    _switchVal(switchVal),
+    _xorChance(slider1Val, TABLE_LENGTH),
+    infos {NULL} {}
+
+    static constexpr int overlayBytes() { return Overlay::bytesFor<struct xorInfo>(13); }
+
+    void attach(Overlay &overlay) override {
+        infos = overlay.take<struct xorInfo>(13);
+        for (int i = 0; i < 13; i++) {
+            infos[i].noise.seed(Random::seedFor(i));
+            infos[i].preparedFreq = 0;
+        }
+    }
+
+    int bytesPerVoice() override { return sizeof(struct xorInfo); }
+
+    /**
+     * a prepared note was made from the editors as they were, so it's made again
+     */
+    void onPatchChange() override {
+        for (int i = 0; i < 13; i++)
+            infos[i].preparedFreq = 0;
+    }
 
     void exportSFZ() {}
-private:
-    Random randy;
 
+    /**
+     * fills the key's table
+     */
+    void prepareNote(struct SoundInfo * sound) override {
+        struct xorInfo * info = &infos[sound->key];
+        if (info->preparedFreq == sound->freq)
+            return;
+        switch (_switchVal) {
+        case 0: // fill random
+            info->noise.randArray(info->table, TABLE_LENGTH, TABLE_MAX);
+            break;
+        case 1: // fill with table
+            for (int i = 0; i < TABLE_LENGTH; i++)
+                info->table[i] = _table[i];
+            break;
+        }
+        info->previous = info->table[TABLE_MAX - 1];
+        info->preparedFreq = sound->freq;
+    }
+private:
     s16 (&_table)[TABLE_LENGTH];
     int &_slider1Val;
     int &_switchVal;
+    Probability _xorChance;
 
     struct xorInfo {
+        Random noise;
+        int preparedFreq; // what prepareNote set a pressed but unplayed key up for. 0 if nothing
         s16 previous;
         s16 table[TABLE_LENGTH];
     };
 
-    struct xorInfo infos[13];
+    struct xorInfo *infos; // in the overlay
 
     int getWavePhase(struct SoundInfo * sound) {
         int phase = div32((sound->phaseFramesElapsed * sound->freq * TABLE_LENGTH), _samplingRate);
@@ -1222,18 +3081,11 @@ private:
 
     s16 getOutputSample(struct SoundInfo * sound) {
         struct xorInfo * info = &infos[sound->key];
-        if (sound->playing) {
+        if (ampEnvelope.sounding(sound)) {
             if (sound->justPressed) {
-                switch (_switchVal) {
-                case 0: // fill random
-                randy.randArray(info->table, TABLE_LENGTH, TABLE_MAX);
-                    break;
-                case 1: // fill with table
-                    for (int i = 0; i < TABLE_LENGTH; i++)
-                        info->table[i] = _table[i];
-                    break;
-                }
-                info->previous = info->table[TABLE_MAX - 1];
+                if (info->preparedFreq != sound->freq)
+                    prepareNote(sound);
+                info->preparedFreq = 0;
                 sound->justPressed = false;
             }
         
@@ -1241,7 +3093,7 @@ private:
             int current = info->table[phase];
             incrementFrameCount(sound);
 
-            if (randy.prob(_slider1Val, TABLE_LENGTH)) {
+            if (info->noise.chance(_xorChance.threshold())) {
                 current ^= info->previous;
                 info->table[phase] = current;
             }
@@ -1267,19 +3119,61 @@ public:
     exor(_gain, _samplingRate, _table, _slider1Val, _switchVal),
     erin(_gain, _samplingRate, _table, _slider1Val, _switchVal) {}
 
-    s16 frameOutput() override {
+    void renderBlock(s16 *dest, int length) override {
         switch (_algorithm) {
             case 0: { // Bubble Sort
-                return bort.frameOutput();
+                bort.renderBlock(dest, length);
+                return;
             }
             case 1: { // XOR
-                return exor.frameOutput();
+                exor.renderBlock(dest, length);
+                return;
             }
             case 2: { // Excited String
-                return erin.frameOutput();
+                erin.renderBlock(dest, length);
+                return;
             }
         }
-        return 0;
+        for (int i = 0; i < length; i++)
+            dest[i] = 0;
+    }
+
+    /**
+     * the algorithm switch changes without a synth switch, so all three are attached at
+     * once. they still only need a fraction of what the wavetable synth takes
+     */
+    static constexpr int overlayBytes() { return BubbleSort::overlayBytes() + XOR::overlayBytes() + ExcitedString::overlayBytes(); }
+
+    void attach(Overlay &overlay) override {
+        bort.attach(overlay);
+        exor.attach(overlay);
+        erin.attach(overlay);
+    }
+
+    int bytesPerVoice() override { return bort.bytesPerVoice() + exor.bytesPerVoice() + erin.bytesPerVoice(); }
+
+    /**
+     * all three hear about it, since the algorithm switch is one of the things that changes
+     */
+    void onPatchChange() override {
+        bort.onPatchChange();
+        exor.onPatchChange();
+        erin.onPatchChange();
+    }
+    int residentBytes() override { return sizeof(Novelty); }
+
+    void prepareNote(struct SoundInfo * sound) override {
+        switch (_algorithm) {
+            case 0:
+                bort.prepareNote(sound);
+                return;
+            case 1:
+                exor.prepareNote(sound);
+                return;
+            case 2:
+                erin.prepareNote(sound);
+                return;
+        }
     }
 
     void exportSFZ() {}
@@ -1298,85 +3192,325 @@ private:
 
 class FM : public Synth {
 public:
-    FM(int gain, int samplingRate, int (&amps)[8], int (&routings)[8], int (&ratios)[8]) :
+    FM(int gain, int samplingRate, int (&amps)[8], int (&routings)[8], int (&ratios)[8], int (&feedbacks)[8], int &algorithm, int &oversampling, ModMatrix &modMatrix) :
         Synth(gain, samplingRate, false),
         _amps (amps),
         _routings (routings),
-        _ratios (ratios)
-    {
+        _ratios (ratios),
+        _feedbacks (feedbacks),
+        _algorithm (algorithm),
+        _oversampling (oversampling),
+        _modMatrix (modMatrix),
+        _envelopeDecay {-1},
+        _oversamplingShift {0},
+        _testPatch {false},
+        _savedPatch {
+            {TABLE_LENGTH / 2, TABLE_LENGTH * 5 / 8, 0, 0, 0, 0, 0, 0},
+            {FM_ROUTE_OUTPUT, 0, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF},
+            {1, 3, 1, 1, 1, 1, 1, 1},
+            {0, 0, 0, 0, 0, 0, 0, 0},
+            0
+        },
+        _orderLength {0},
+        _numCarriers {0},
+        infos {NULL} {} // attach comes first, then onPatchChange compiles the routing
+
+    static constexpr int overlayBytes() { return Overlay::bytesFor<struct fmInfo>(13); }
+
+    void attach(Overlay &overlay) override {
+        infos = overlay.take<struct fmInfo>(13);
         for (int i = 0; i < 13; i++) {
-            for (int j = 0; j < 4; j++) {
-                infos[i].ops[j] = new Operator(_samplingRate, infos[i].ops, 4, j, _amps[j], _routings[j], _ratios[j]);
+            for (int j = 0; j < FM_OPERATORS; j++) {
+                infos[i].phases[j] = 0;
+                infos[i].freqs[j] = -1;
+                infos[i].outputs[j] = 0;
+                infos[i].previousOutputs[j] = 0;
+            }
+            infos[i].controlFramesLeft = 0;
+        }
+        for (int i = 0; i < FM_MAX_OVERSAMPLING; i++)
+            _decimators[i].reset();
+    }
+
+    /**
+     * NOTE TO FUTURE PROGRAMMERS - The operator graph
+     * The routing editor says, for each operator, which operator it modulates (0 to
+     * FM_OPERATORS - 1), whether it goes straight to the output (FM_ROUTE_OUTPUT), or
+     * whether it is off (FM_ROUTE_OFF). The algorithm switch can swap the editor out for one
+     * of the presets below. Rather than have every operator go looking for its modulators
+     * every sample, the routing is compiled here whenever the patch changes into a list of
+     * operators to evaluate in order, modulators before the operators they modulate, plus
+     * a list of each operator's modulators. Every sample each operator in the list is
+     * evaluated exactly once and its output kept in the voice's outputs array, where
+     * whatever it modulates picks it up.
+     *
+     * An operator that can't be reached from the output is left out of the list, since
+     * nothing would ever hear it. Each operator modulates only one other, so the list is
+     * built by walking back from the carriers, and every operator is reached once at
+     * most. Operators routed round in a loop (1 into 2 into 1) never lead to a carrier,
+     * so they are dropped along with anything that modulates them, and go silent.
+     * Feeding an operator back into itself is what the feedback sliders are for.
+     */
+    void onPatchChange() override {
+        compileRouting();
+        if (_oversampling != _oversamplingShift)
+            setOversampling(_oversampling);
+    }
+
+    void compileRouting() {
+        const int *routing = _algorithm == 0 ? _routings : presetRouting(_algorithm - 1);
+        for (int i = 0; i < FM_OPERATORS; i++) {
+            _activeRouting[i] = routing[i];
+            _numInputs[i] = 0;
+        }
+        _orderLength = 0;
+        _numCarriers = 0;
+        for (int i = 0; i < FM_OPERATORS; i++) {
+            if (_activeRouting[i] == FM_ROUTE_OUTPUT) {
+                _carriers[_numCarriers++] = i;
+                compile(i);
             }
         }
     }
 
+    /**
+     * NOTE TO FUTURE PROGRAMMERS - Oversampling
+     * Turn the modulation up and FM makes harmonics well past the Nyquist frequency,
+     * which fold back down as harsh, unrelated tones. With oversampling on, every voice
+     * renders at 2 or 4 times the output rate, and the mix of all of them goes through
+     * one HalfBand per halving on its way down to the output rate. Filtering the mix
+     * rather than each voice means the filter costs the same however many keys are down.
+     */
+    void renderBlock(s16 *dest, int length) override {
+        int shift = _oversamplingShift;
+        while (length > 0) {
+            int frames = length < (MIX_BLOCK >> shift) ? length : (MIX_BLOCK >> shift);
+            mixVoices(frames << shift);
+            for (int i = 0; i < shift; i++)
+                _decimators[i].decimate(mixBuffer, frames << (shift - i));
+            for (int i = 0; i < frames; i++)
+                dest[i] = _gain * mixBuffer[i];
+            dest += frames;
+            length -= frames;
+        }
+    }
+
+    int renderRate() override { return _samplingRate << _oversamplingShift; }
+
+    int getOversampling() override { return _oversamplingShift; }
+
+    /**
+     * the operators' increments and the modulation envelope are worked out for the
+     * render rate, so they're all redone at the new one
+     */
+    void setOversampling(int shift) override {
+        _oversamplingShift = shift;
+        _envelopeDecay = -1;
+        for (int i = 0; i < 13; i++)
+            for (int j = 0; j < FM_OPERATORS; j++)
+                infos[i].freqs[j] = -1;
+        for (int i = 0; i < FM_MAX_OVERSAMPLING; i++)
+            _decimators[i].reset();
+    }
+
+    int bytesPerVoice() override { return sizeof(struct fmInfo); }
+    int residentBytes() override { return sizeof(FM); }
+    int getOperatorCount() override { return _orderLength; }
+
+    /**
+     * one loud modulator at 3 times the carrier, which puts sidebands well past the
+     * Nyquist frequency. the modulation envelope is held open so the spectrum holds still
+     */
+    bool useTestPatch(bool on) override {
+        if (on == _testPatch)
+            return true;
+        _testPatch = on;
+        for (int i = 0; i < FM_OPERATORS; i++) {
+            swap(_amps[i], _savedPatch.amps[i]);
+            swap(_routings[i], _savedPatch.routings[i]);
+            swap(_ratios[i], _savedPatch.ratios[i]);
+            swap(_feedbacks[i], _savedPatch.feedbacks[i]);
+        }
+        swap(_algorithm, _savedPatch.algorithm);
+        compileRouting(); // not onPatchChange, the benchmark picks the oversampling itself
+        return true;
+    }
+
     void exportSFZ() {}
 private:
     int (&_amps)[8];
     int (&_routings)[8];
     int (&_ratios)[8];
+    int (&_feedbacks)[8];
+    int &_algorithm;
+    int &_oversampling;
+    ModMatrix &_modMatrix;
+    int _envelopeDecay;
+    int _envelopeCoefficient;
+    int _oversamplingShift;
+    HalfBand _decimators[FM_MAX_OVERSAMPLING];
+
+    // while the test patch is on, this holds the player's patch, and the other way round
+    bool _testPatch;
+    struct {
+        int amps[FM_OPERATORS];
+        int routings[FM_OPERATORS];
+        int ratios[FM_OPERATORS];
+        int feedbacks[FM_OPERATORS];
+        int algorithm;
+    } _savedPatch;
+
+    static void swap(int &a, int &b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
 
-    class Operator {
-    public:
-        Operator(int samplingRate, Operator **ops, int numOps, int id, int &amp, int &routing, int &ratio) :
-            _sine(samplingRate),
-            _ops {ops},
-            _numOps {numOps},
-            _id {id},
-            _amp (amp),
-            _routing (routing),
-            _ratio (ratio) {}
-
-        s16 evaluate(int freq) {
-            if (_routing == 5) {
-                return 0;
-            } else {
-                bool doReset = false; // _sine._phase > 65536;
-                if (doReset)
-                    resetSine();
-                s16 modulatorOutput = 0;
-                for (int i = 0; i < _numOps; i++) { // look for modulators
-                    if (_ops[i]->_routing == _id) { // if another operator has this one as a carrier, then...
-                        if (doReset)
-                            _ops[i]->resetSine();
-                        modulatorOutput += _ops[i]->evaluate(freq) / 256;
-                    }
-                }
-                return _amp * _sine.sin(_ratio*freq + modulatorOutput) / TABLE_LENGTH;
-            }
+    int _activeRouting[FM_OPERATORS];
+    int _order[FM_OPERATORS];
+    int _orderLength;
+    int _inputs[FM_OPERATORS][FM_OPERATORS];
+    int _numInputs[FM_OPERATORS];
+    int _carriers[FM_OPERATORS];
+    int _numCarriers;
+
+    /**
+     * Everything one voice needs to run its operators, an array per field so that each
+     * voice is one contiguous block and nothing gets allocated.
+     */
+    struct fmInfo {
+        u32 phases[FM_OPERATORS];
+        u32 increments[FM_OPERATORS];
+        int freqs[FM_OPERATORS]; // what the increments were worked out for
+        int amps[FM_OPERATORS]; // read from the editors once per control period
+        s16 outputs[FM_OPERATORS];
+        s16 previousOutputs[FM_OPERATORS]; // for feedback, which averages the last two
+        int controlFramesLeft;
+        Envelope envelope;
+    };
+    struct fmInfo *infos; // in the overlay
+
+    /**
+     * DX style algorithms. Each row is a routing, in the same terms as the routing editor
+     *
+     * @param preset from 0 to FM_PRESETS - 1
+     */
+    static const int *presetRouting(int preset) {
+        const int O = FM_ROUTE_OUTPUT;
+        static const int presets[FM_PRESETS][FM_OPERATORS] = {
+            {O, 0, 1, 2, 3, 4, 5, 6}, // one stack, 8 into 7 into ... into 1
+            {O, 0, 1, 2, O, 4, 5, 6}, // two stacks of four
+            {O, 0, O, 2, O, 4, O, 6}, // four modulator and carrier pairs
+            {O, 0, 0, 0, 0, 0, 0, 0}, // seven modulators on one carrier
+            {O, 0, 1, 1, O, 4, 5, 5}, // two trees, each with two modulators on a modulator
+            {O, O, O, O, O, O, O, O}, // all carriers, like drawbars on an organ
+        };
+        return presets[preset];
+    }
+
+    /**
+     * depth first walk from op back through its modulators, appending each operator to
+     * the evaluation order once all of its modulators are in it. an operator only has the
+     * one route, so nothing is walked twice
+     */
+    void compile(int op) {
+        for (int i = 0; i < FM_OPERATORS; i++) {
+            if (_activeRouting[i] != op)
+                continue;
+            _inputs[op][_numInputs[op]++] = i;
+            compile(i);
         }
+        _order[_orderLength++] = op;
+    }
+
+    void controlTick(struct SoundInfo * sound) {
+        struct fmInfo * info = &infos[sound->key];
 
-        bool doOutput() {
-            return _routing == 4; 
+        if (_modMatrix.envelopeDecay() != _envelopeDecay) {
+            _envelopeDecay = _modMatrix.envelopeDecay();
+            _envelopeCoefficient = Envelope::coefficient(_envelopeDecay, controlRate());
         }
-    private:
-        Sine _sine;
-        Operator **_ops;
-        int _numOps;
-        int _id;
-        int &_amp;
-        int &_routing;
-        int &_ratio;
 
-        void resetSine() {
-            _sine.reset();
+        int sources[ModMatrix::NUM_SOURCES];
+        sources[ModMatrix::SOURCE_LFO] = 0;
+        sources[ModMatrix::SOURCE_ENVELOPE] = info->envelope.tick(_envelopeCoefficient);
+
+        // with the envelope all the way up the modulators play at the amplitude the editor
+        // says. as it decays they get quieter by up to the route amount
+        int ampScale = MOD_ONE
+            - _modMatrix.depth(ModMatrix::DEST_FM_AMP)
+            + _modMatrix.modulation(ModMatrix::DEST_FM_AMP, sources);
+        if (_testPatch)
+            ampScale = MOD_ONE;
+
+        for (int i = 0; i < _orderLength; i++) {
+            int op = _order[i];
+            int freq = _ratios[op] * sound->freq;
+            if (freq != info->freqs[op]) {
+                info->freqs[op] = freq;
+                info->increments[op] = ((u64)freq << 32) / renderRate();
+            }
+            if (_activeRouting[op] == FM_ROUTE_OUTPUT)
+                info->amps[op] = _amps[op];
+            else
+                info->amps[op] = (_amps[op] * ampScale) >> MOD_SHIFT;
         }
-    };
+        info->controlFramesLeft = CONTROL_PERIOD;
+    }
 
-    struct fmInfo {
-        Operator *ops[4];
-    };
-    struct fmInfo infos[13];
+    void renderSound(struct SoundInfo * sound, int *mix, int length) override {
+        if (!ampEnvelope.sounding(sound))
+            return;
+        struct fmInfo * info = &infos[sound->key];
+        if (sound->justPressed) {
+            info->envelope.trigger();
+            info->controlFramesLeft = 0;
+            for (int i = 0; i < FM_OPERATORS; i++) {
+                info->phases[i] = 0;
+                info->outputs[i] = 0;
+                info->previousOutputs[i] = 0;
+            }
+            sound->justPressed = false;
+        }
+        while (length > 0) {
+            if (info->controlFramesLeft == 0)
+                controlTick(sound);
+            int frames = length < info->controlFramesLeft ? length : info->controlFramesLeft;
+            info->controlFramesLeft -= frames;
+            length -= frames;
+            for (; frames; frames--)
+                *mix++ += getOutputSample(sound);
+        }
+    }
 
+    /**
+     * advances every operator the routing uses by one sample. a modulator's output moves
+     * its carrier's phase, so this is really phase modulation, like most FM synths do
+     */
     s16 getOutputSample(struct SoundInfo * sound) {
-        if (sound->playing) {
-            s16 output = 0;
-            for (int i = 0; i < 4; i++) {
-                if (infos[sound->key].ops[i]->doOutput()) {
-                    output += infos[sound->key].ops[i]->evaluate(sound->freq);
-                }
+        if (ampEnvelope.sounding(sound)) {
+            struct fmInfo * info = &infos[sound->key];
+            for (int i = 0; i < _orderLength; i++) {
+                int op = _order[i];
+                int modulation = 0;
+                for (int j = 0; j < _numInputs[op]; j++)
+                    modulation += info->outputs[_inputs[op][j]];
+                if (_feedbacks[op])
+                    modulation += ((info->outputs[op] + info->previousOutputs[op]) * _feedbacks[op]) >> FM_FEEDBACK_SHIFT;
+                u32 phase = info->phases[op] + ((u32)modulation << (32 - ANGLE_BITS + FM_INDEX_SHIFT));
+                info->phases[op] += info->increments[op];
+                info->previousOutputs[op] = info->outputs[op];
+                info->outputs[op] = info->amps[op] * sineTable.lookup(phase) / TABLE_LENGTH;
             }
+            // each carrier can swing nearly all of an s16 by itself, and the organ preset
+            // has all 8 on the output, so the sum clips rather than wrapping around
+            int output = 0;
+            for (int i = 0; i < _numCarriers; i++)
+                output += info->outputs[_carriers[i]];
+            if (output > 32767)
+                return 32767;
+            if (output < -32768)
+                return -32768;
             return output;
         } else {
             return 0;
@@ -1397,65 +3531,249 @@ public:
         Synth(gain, samplingRate, false),
         _blendFactor (blendFactor),
         _burstType (burstType),
-        _burstArray (burstArray)
-    {}
+        _burstArray (burstArray),
+        _blend(blendFactor, TABLE_LENGTH - 1),
+        plucks {NULL},
+        stringBuffers {NULL} {}
+
+    /**
+     * takes the delay pool, and the voices after it
+     */
+    static constexpr int overlayBytes() {
+        return DelayPool::overlayBytes() + Overlay::bytesFor<struct pluckInfo>(13) + Overlay::bytesFor<int>(13 * MIX_BLOCK);
+    }
+
+    void attach(Overlay &overlay) override {
+        delayPool.attach(overlay);
+        plucks = overlay.take<struct pluckInfo>(13);
+        stringBuffers = overlay.take<int>(13 * MIX_BLOCK);
+        for (int i = 0; i < 13; i++) {
+            plucks[i].noise.seed(Random::seedFor(i));
+            plucks[i].preparedFreq = 0;
+            plucks[i].length = 1;
+            plucks[i].position = 0;
+            plucks[i].previous = 0;
+            plucks[i].line = delayPool.lineFor(i);
+        }
+    }
 
     void exportSFZ() {}
+
+    int bytesPerVoice() override { return sizeof(struct pluckInfo); }
+
+    /**
+     * a prepared note was made from the editors as they were, so it's made again
+     */
+    void onPatchChange() override {
+        for (int i = 0; i < 13; i++)
+            plucks[i].preparedFreq = 0;
+    }
+    int residentBytes() override { return sizeof(PluckedString); }
+
+    /**
+     * takes a delay line for the key and fills it with the burst
+     */
+    void prepareNote(struct SoundInfo * sound) override {
+        struct pluckInfo *pluck = &plucks[sound->key];
+        if (pluck->preparedFreq == sound->freq)
+            return;
+        // 1. calculate length, tuned to a fraction of a sample, and take a delay line that long
+        pluck->length = pluck->tuning.tune(_samplingRate, sound->freq, 32768);
+        pluck->line = delayPool.take(sound->key, pluck->length);
+        if (pluck->length > pluck->line->mask + 1)
+            pluck->length = pluck->line->mask + 1;
+        // 2. fill the burst table
+        switch (_burstType) {
+            case 0: { // fill the burst table with random
+                pluck->noise.randArray(pluck->line->samples, pluck->length, TABLE_MAX);
+                break;
+            }
+            case 1: { // fill the burst table with a squeezed rendition of the burstArray (filled by a table editor)
+                for (int i = 0; i < pluck->length; i++) {
+                    pluck->line->samples[i] = _burstArray[Lerp::lerp(0, TABLE_LENGTH - 1, i, pluck->length - 1)];
+                }
+                break;
+            }
+        }
+        pluck->position = pluck->length;
+        // 3. initialize previous
+        pluck->previous = pluck->line->samples[0];
+        pluck->preparedFreq = sound->freq;
+    }
 private:
     int &_blendFactor;
     int &_burstType;
     s16 (&_burstArray)[TABLE_LENGTH];
 
     struct pluckInfo {
+        Random noise;
+        int preparedFreq; // what prepareNote set a pressed but unplayed key up for. 0 if nothing
         int length;
-        int phase;
+        int position; // where the next sample is written. the sample length before it is read
         int previous;
-        int table[3000];
+        struct DelayPool::line *line;
+        FractionalDelay tuning;
     };
 
-    Random randy;
+    /**
+     * what the string kernel needs of one string for a block, copied out of its pluckInfo
+     * at the start of the block and back at the end
+     */
+    struct stringLane {
+        s16 *samples;
+        int mask;
+        int delay;
+        int position;
+        int previous;
+        FractionalDelay tuning;
+        u32 keeps[MIX_BLOCK / 32]; // bit i set if sample i keeps its sign
+        int *output;
+    };
 
-    struct pluckInfo plucks[13];
-    
-    s16 getOutputSample(struct SoundInfo * sound) {
-        if (sound->playing) {
-            struct pluckInfo *pluck = &plucks[sound->key];
-            if (sound->justPressed) {
-                // 1. calculate length
-                pluck->length = _samplingRate / sound->freq;
-                // 2. fill the burst table
-                switch (_burstType) {
-                    case 0: { // fill the burst table with random
-                        for (int i = 0; i < pluck->length; i++) {
-                            pluck->table[i] = rand() % TABLE_MAX;
-                        }
-                        break;
-                    }
-                    case 1: { // fill the burst table with a squeezed rendition of the burstArray (filled by a table editor)
-                        for (int i = 0; i < pluck->length; i++) {
-                            pluck->table[i] = _burstArray[Lerp::lerp(0, TABLE_LENGTH - 1, i, pluck->length - 1)];
-                        }
-                        break;
-                    }
-                }
-                pluck->phase = 0;
-                // 3. initialize previous
-                pluck->previous = pluck->table[0];
-                // 4. the key is no longer just pressed
-                sound->justPressed = false;
+    Probability _blend;
+
+    struct pluckInfo *plucks; // in the overlay
+    int *stringBuffers; // MIX_BLOCK samples per key, in the overlay
+
+    /**
+     * NOTE TO FUTURE PROGRAMMERS - Stepping the strings together
+     * Rather than run each key's string through its own loop, the plucked string steps
+     * every sounding string one sample, then every string the next sample, and so on
+     * through the block. Each string's next sample only depends on its own last one, so
+     * interleaving them gives the CPU work that doesn't have to wait on the multiply or
+     * load just before it. The strings' state is copied into an array of lanes on the
+     * stack (which is in the fast DTCM on the DS) for the block, so the inner loop
+     * touches nothing in main RAM but the delay lines. Whether each sample keeps its sign
+     * (a plucked string) or flips it (a drum) is decided up front as a block of chances
+     * per string, so there is no call to the random number generator or the
+     * probability in the loop.
+     *
+     * Each string comes out into its own buffer, which then goes through the key's
+     * amplitude envelope into the mix, the same as any other synth's voices.
+     */
+    void renderBlock(s16 *dest, int length) override {
+        for (int i = 0; i < length; i++)
+            mixBuffer[i] = 0;
+        ampEnvelope.refresh(controlRate());
+        struct stringLane lanes[13];
+        struct SoundInfo *lanesSounds[13];
+        int count = 0;
+        for (int i = 0; i < 13; i++) {
+            struct SoundInfo * sound = &sounds[i];
+            ampEnvelope.gate(sound);
+            if (!ampEnvelope.sounding(sound))
+                continue;
+            startLane(sound, &lanes[count], stringBuffers + count * MIX_BLOCK, length);
+            lanesSounds[count++] = sound;
+        }
+        stepStrings(lanes, count, length);
+        for (int i = 0; i < count; i++) {
+            finishLane(lanesSounds[i], &lanes[i]);
+            ampEnvelope.render(lanesSounds[i], lanes[i].output, mixBuffer, length);
+        }
+        for (int i = 0; i < length; i++)
+            dest[i] = mixBuffer[i];
+    }
+
+    /**
+     * copies a key's string into a lane and rolls its chances for the block
+     */
+    void startLane(struct SoundInfo * sound, struct stringLane *lane, int *output, int length) {
+        struct pluckInfo *pluck = &plucks[sound->key];
+        if (sound->justPressed) {
+            // the main loop has usually prepared the note already
+            if (pluck->preparedFreq != sound->freq)
+                prepareNote(sound);
+            pluck->preparedFreq = 0;
+            // the key is no longer just pressed
+            sound->justPressed = false;
+        }
+        pluck->noise.chances(lane->keeps, length, _blend.threshold());
+        lane->samples = pluck->line->samples;
+        lane->mask = pluck->line->mask;
+        lane->delay = pluck->length;
+        lane->position = pluck->position;
+        lane->previous = pluck->previous;
+        lane->tuning = pluck->tuning;
+        lane->output = output;
+    }
+
+    void finishLane(struct SoundInfo * sound, struct stringLane *lane) {
+        struct pluckInfo *pluck = &plucks[sound->key];
+        pluck->position = lane->position;
+        pluck->previous = lane->previous;
+        pluck->tuning = lane->tuning;
+    }
+
+    /**
+     * the string kernel. for every sample, each lane reads the sample its delay behind,
+     * averages it with the last one, flips it if it's a drum, tunes it with the all pass
+     * and writes it back into the line
+     */
+    void stepStrings(struct stringLane *lanes, int count, int length) {
+        struct stringLane *end = lanes + count;
+        for (int i = 0; i < length; i++) {
+            u32 bit = 1u << (i & 31);
+            int word = i >> 5;
+            for (struct stringLane *lane = lanes; lane < end; lane++) {
+                int current = lane->samples[(lane->position - lane->delay) & lane->mask];
+                int average = (current + lane->previous) >> 1;
+                if (!(lane->keeps[word] & bit))
+                    average = -average;
+                int output = lane->tuning.process(average);
+                lane->samples[lane->position++ & lane->mask] = output;
+                lane->previous = current;
+                lane->output[i] = _gain * output;
             }
-            int phase = pluck->phase++ % pluck->length;
-            int current = pluck->table[phase];
-            pluck->table[phase] = (randy.prob(_blendFactor, TABLE_LENGTH - 1) ? 1 : -1) * ((current + pluck->previous) >> 1);
-            pluck->previous = current;
-            return _gain * pluck->table[phase];
-        } else {
-            return 0;
         }
     }
 
+    /**
+     * one key on its own, through the same kernel
+     */
+    void renderSound(struct SoundInfo * sound, int *mix, int length) override {
+        struct stringLane lane;
+        startLane(sound, &lane, stringBuffers, length);
+        stepStrings(&lane, 1, length);
+        finishLane(sound, &lane);
+        for (int i = 0; i < length; i++)
+            mix[i] += lane.output[i];
+    }
+
+    s16 getOutputSample(struct SoundInfo * sound) {
+        int sample = 0;
+        if (ampEnvelope.sounding(sound))
+            renderSound(sound, &sample, 1);
+        return sample;
+    }
+
 };
 
+#if WAVETABLE_FRAME_BITS == 8
+typedef u8 frame_t;
+#else
+typedef s16 frame_t;
+#endif
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - Frames mode
+ *
+ * In "two waves" mode the Wavetable synth works out the transition between wave 1 and
+ * wave 2 for every sample of every voice. In "frames" mode it instead keeps a store of
+ * WAVETABLE_FRAMES precomputed single cycle waves, evenly spaced along the transition,
+ * with wave 1 as the first keyframe and wave 2 as the last. The frames in between are
+ * filled in with whichever transition algorithm is selected. Playing a voice is then
+ * just picking a frame once per control tick (from the transition shape and the LFO)
+ * and reading one byte per sample out of it.
+ *
+ * The frame store is rebuilt in the main loop a few frames at a time whenever an
+ * editor changes, so that drawing doesn't stall the screen.
+ *
+ * In two waves mode a voice can still end up playing from a frame: once its transition
+ * stops moving (a forward mode note past the end of the shape, or a flat shape with no
+ * LFO), its cycle is rendered once into a cycle cache for that voice and played back
+ * with the frames kernel until the transition moves again or the patch changes.
+ */
 class Wavetable : public Synth {
 public:
     Wavetable(
@@ -1466,7 +3784,12 @@ public:
         s16 (&transition)[TABLE_LENGTH],
         int &transitionTime,
         int &algorithm,
-        int &transitionCycle
+        int &transitionCycle,
+        int &wavetableMode,
+        int &unisonVoices,
+        int &unisonDetune,
+        int &syncRatio,
+        ModMatrix &modMatrix
      ) :
         Synth(gain, samplingRate, true),
         _wave1Array (wave1Array),
@@ -1474,7 +3797,18 @@ public:
         _transition (transition),
         _transitionTime (transitionTime),
         _algorithm (algorithm),
-        _transitionCycle (transitionCycle)
+        _transitionCycle (transitionCycle),
+        _wavetableMode (wavetableMode),
+        _unisonVoices (unisonVoices),
+        _unisonDetune (unisonDetune),
+        _syncRatio (syncRatio),
+        _modMatrix (modMatrix),
+        _lfoRate {-1},
+        _frames {NULL},
+        _framesBuilt {0},
+        _cycleCaches {NULL},
+        _spectraReady {false},
+        infos {NULL}
     {
         for (int i = 0; i < TABLE_LENGTH; i++) {
             wave1Array[i] = 0;
@@ -1483,7 +3817,67 @@ public:
         }
     }
 
-    
+    /**
+     * the frame store and the cycle caches are by far the biggest thing in the overlay.
+     * onPatchChange, which comes next, starts rebuilding them
+     */
+    static constexpr int overlayBytes() {
+        return Overlay::bytesFor<frame_t>(WAVETABLE_FRAMES * PLAYBACK_LENGTH)
+            + Overlay::bytesFor<frame_t>(13 * PLAYBACK_LENGTH)
+            + Overlay::bytesFor<struct wableInfo>(13);
+    }
+
+    void attach(Overlay &overlay) override {
+        _frames = (frame_t (*)[PLAYBACK_LENGTH])overlay.take<frame_t>(WAVETABLE_FRAMES * PLAYBACK_LENGTH);
+        _cycleCaches = (frame_t (*)[PLAYBACK_LENGTH])overlay.take<frame_t>(13 * PLAYBACK_LENGTH);
+        infos = overlay.take<struct wableInfo>(13);
+    }
+
+    /**
+     * The table editors work at screen resolution, which is a strange length to play
+     * back. Every time one of them changes, both waves are resampled into power of two
+     * long playback tables so that the phase can simply wrap around.
+     */
+    void onPatchChange() override {
+        resampleTable(_wave1Array, _playback1);
+        resampleTable(_wave2Array, _playback2);
+        _framesBuilt = 0;
+        _spectraReady = false;
+        for (int i = 0; i < 13; i++)
+            infos[i].cacheState = CACHE_NONE;
+    }
+
+    void doBackgroundWork() override {
+        buildCycleCaches();
+        if (!usesFrameStore())
+            return;
+        for (int i = 0; i < FRAMES_PER_IDLE && _framesBuilt < WAVETABLE_FRAMES; i++)
+            buildFrame(_framesBuilt++);
+    }
+
+    void finishBackgroundWork() override {
+        if (!usesFrameStore())
+            return;
+        while (_framesBuilt < WAVETABLE_FRAMES)
+            buildFrame(_framesBuilt++);
+    }
+
+    int bytesPerVoice() override { return sizeof(struct wableInfo); }
+
+    int getUnisonCopies() override { return _unisonVoices + 1; }
+    void setUnisonCopies(int copies) override { _unisonVoices = copies - 1; }
+    int residentBytes() override { return sizeof(Wavetable); }
+
+    /**
+     * the voices are mixed without gain, so the gain is applied once per sample of the
+     * mix instead of once per sample of every voice
+     */
+    void renderBlock(s16 *dest, int length) override {
+        mixVoices(length);
+        for (int i = 0; i < length; i++)
+            dest[i] = _gain * mixBuffer[i];
+    }
+
 private:
     s16 (&_wave1Array)[TABLE_LENGTH];
     s16 (&_wave2Array)[TABLE_LENGTH];
@@ -1491,43 +3885,358 @@ private:
     int &_transitionTime;
     int &_algorithm;
     int &_transitionCycle;
+    int &_wavetableMode;
+    int &_unisonVoices; // 0 means no unison, 7 means 8 copies
+    int &_unisonDetune; // in cents
+    int &_syncRatio; // 0 is off, otherwise the synced oscillator runs 1 + _syncRatio / 100 times faster
+    ModMatrix &_modMatrix;
+    int _lfoRate;
+    u32 _lfoIncrement;
+
+    // the waves are never taller than TABLE_MAX, so a byte per sample is plenty
+    u8 _playback1[PLAYBACK_LENGTH] __attribute__((aligned(32)));
+    u8 _playback2[PLAYBACK_LENGTH] __attribute__((aligned(32)));
+
+    // one frame after another, so a voice only ever touches one PLAYBACK_LENGTH run of it.
+    // WAVETABLE_FRAMES of them, in the overlay
+    frame_t (*_frames)[PLAYBACK_LENGTH];
+    int _framesBuilt;
+
+    // one cycle per voice, for notes that have settled on a single cycle. in the overlay
+    frame_t (*_cycleCaches)[PLAYBACK_LENGTH];
+
+    // the harmonics of both waves, for the spectral morph. bins above the middle mirror these
+    int _magnitudes1[SPECTRAL_LENGTH / 2 + 1];
+    int _magnitudes2[SPECTRAL_LENGTH / 2 + 1];
+    int _phases1[SPECTRAL_LENGTH / 2 + 1];
+    int _phases2[SPECTRAL_LENGTH / 2 + 1];
+    bool _spectraReady;
+
+    // band limiting and hard sync for one unison copy. see bandLimitedSample
+    struct edgeInfo {
+        u32 lastReadPhase; // the phase the last sample was read at
+        u32 blepScale; // BLEP_LENGTH << 32 / the copy's increment, to turn phases into table indexes
+        u32 syncPhase; // the phase of the synced oscillator. the copy's own phase is the one it syncs to
+        u32 syncIncrement; // 0 when hard sync is off
+        u32 syncBlepScale;
+    };
 
     struct wableInfo {
+        u32 phase; // the top PLAYBACK_BITS are the index into the playback tables
+        u32 phaseIncrement;
+        int cyclesElapsed; // only kept track of while exporting
         int transitionFramesElapsed;
         bool pingPongDirection;
+        int controlFramesLeft;
+        int transitionFraction; // how far from wave 1 to wave 2 we are, out of 1 << 16. ramps between ticks
+        int transitionStep; // added to transitionFraction every sample
+        int transitionTarget; // where transitionFraction will be at the next tick
+        const frame_t *frame; // the frame to play until the next tick, in frames mode
+        Lfo lfo;
+
+        // the extra unison copies. the voice itself is the first copy, and uses phase
+        int unisonCopies;
+        int unisonScale; // out of 1 << 16, so all the copies together are as loud as one
+        u32 unisonPhases[UNISON_MAX - 1];
+        u32 unisonIncrements[UNISON_MAX - 1];
+
+        int cacheState; // CACHE_NONE, CACHE_WANTED or CACHE_READY
+        int cacheFraction; // the transition fraction the cycle cache is (or will be) rendered at
+
+        // band limiting. see bandLimitedSample
+        bool bandLimited; // which path the last samples were rendered on
+        int blepPending; // the last sample of all the copies, held back one sample in case the next edge needs to bend it
+        int syncRatio; // the editor value the sync increments were worked out for
+        struct edgeInfo edges[UNISON_MAX]; // the voice's own copy first
     };
 
-    struct wableInfo infos[13];
+    struct wableInfo *infos; // in the overlay
 
     
 
-    int getWavePhase(struct SoundInfo * sound) {
-	    int phase = div32((sound->phaseFramesElapsed * sound->freq * TABLE_LENGTH), _samplingRate);
-        
-        /*phase %= TABLE_LENGTH;
-        sound->phaseFramesElapsed %= _samplingRate;
-        if (sound->phaseFramesElapsed == 0) {
-            if (wavExport.exporting) {
-                // if the transition cycle is in forward mode and the export frames elapsed is greater than the max transition time,
-                // then we need to start setting up loop points and end the exporting process
-                if (_transitionCycle == 0 && wavExport.exportFramesElapsed > _transitionTime) {
-                    if (wavExport.loopStart == -1) {
-                        wavExport.loopStart = wavExport.exportFramesElapsed;
-                    } else {
-                        wavExport.loopEnd = wavExport.exportFramesElapsed;
-                        wavExport.exporting = false;
-                    }
-                }
+    enum { ALGORITHM_MORPH, ALGORITHM_SWIPE, ALGORITHM_COMBO, ALGORITHM_SPECTRAL, NUM_ALGORITHMS };
+    enum { CYCLE_FORWARD, CYCLE_LOOP, CYCLE_PING_PONG, NUM_CYCLES };
+    enum { MODE_TWO_WAVES, MODE_FRAMES };
+    enum { CACHE_NONE, CACHE_WANTED, CACHE_READY };
+
+    // frames mode gets its own kernels, one row past the real algorithms
+    enum { KERNEL_FRAMES = NUM_ALGORITHMS, NUM_KERNEL_ROWS };
+
+    /**
+     * the spectral morph is far too slow to do per sample, so it always plays from the
+     * frame store, whatever the wavetable mode switch says
+     */
+    bool usesFrameStore() {
+        return _wavetableMode == MODE_FRAMES || _algorithm == ALGORITHM_SPECTRAL;
+    }
+
+    /**
+     * NOTE TO FUTURE PROGRAMMERS - Kernels
+     *
+     * The algorithm and transition cycle switches only change when someone touches an
+     * editor, but checking them cost a switch statement per sample per voice. Instead,
+     * renderFrames is a template that gets compiled once for every combination of
+     * algorithm, cycle mode and whether or not we're exporting. The right one is picked
+     * once per block, and inside it all of those checks disappear.
+     */
+    typedef void (Wavetable::*Kernel)(struct SoundInfo *, struct wableInfo *, int *, int);
+
+    static const Kernel kernels[NUM_KERNEL_ROWS][NUM_CYCLES][2];
+
+    Kernel selectKernel() {
+        int algorithm = (_algorithm >= 0 && _algorithm < NUM_ALGORITHMS) ? _algorithm : ALGORITHM_MORPH;
+        if (usesFrameStore())
+            algorithm = KERNEL_FRAMES;
+        return selectKernel(algorithm);
+    }
+
+    Kernel selectKernel(int algorithm) {
+        int cycle = (_transitionCycle >= 0 && _transitionCycle < NUM_CYCLES) ? _transitionCycle : CYCLE_FORWARD;
+        return kernels[algorithm][cycle][wavExport.exporting ? 1 : 0];
+    }
+
+    /**
+     * stretches a table drawn at screen resolution over PLAYBACK_LENGTH samples,
+     * linearly interpolating between the drawn points
+     */
+    static void resampleTable(s16 (&table)[TABLE_LENGTH], u8 (&playback)[PLAYBACK_LENGTH]) {
+        for (int i = 0; i < PLAYBACK_LENGTH; i++) {
+            int position = i * TABLE_LENGTH; // table index << PLAYBACK_BITS
+            int index = position >> PLAYBACK_BITS;
+            int fraction = position & (PLAYBACK_LENGTH - 1);
+            int current = table[index];
+            int next = table[(index + 1 < TABLE_LENGTH) ? index + 1 : 0];
+            playback[i] = current + (((next - current) * fraction) >> PLAYBACK_BITS);
+        }
+    }
+
+    /**
+     * sets up band limiting and hard sync when a note starts, and keeps the sync ratio up
+     * to date with the editor after that
+     */
+    void startBandLimiting(struct wableInfo * info) {
+        for (int c = 0; c < info->unisonCopies; c++) {
+            u32 increment = copyIncrement(info, c);
+            info->edges[c].blepScale = ((u64)BLEP_LENGTH << 32) / (increment ? increment : 1);
+        }
+        info->syncRatio = -1;
+        updateSync(info);
+        info->bandLimited = false; // the first band limited sample picks the edges up from there
+    }
+
+    void updateSync(struct wableInfo * info) {
+        if (info->syncRatio == _syncRatio)
+            return;
+        info->syncRatio = _syncRatio;
+        u32 ratio = (1 << 16) + ((_syncRatio << 16) / 100);
+        for (int c = 0; c < info->unisonCopies; c++) {
+            struct edgeInfo * edge = &info->edges[c];
+            if (_syncRatio <= 0) {
+                edge->syncIncrement = 0;
+                continue;
             }
+            edge->syncIncrement = ((u64)copyIncrement(info, c) * ratio) >> 16;
+            edge->syncBlepScale = ((u64)BLEP_LENGTH << 32) / (edge->syncIncrement ? edge->syncIncrement : 1);
         }
-        return phase;*/
+    }
 
-        if (phase > 8 * TABLE_LENGTH) {
-            sound->phaseFramesElapsed = 0;
+    /**
+     * picks the edge tracking of every copy up from wherever its phase is now, as if the
+     * synced oscillators had been running since their masters last wrapped. this happens
+     * whenever a voice moves onto the band limited path, when its note starts or when a
+     * sync or algorithm edit moves a held note over, so nothing left over from before
+     * gets mistaken for an edge or played as the held back sample
+     */
+    template <int Algorithm>
+    void restartEdges(struct wableInfo * info, const frame_t *frame, int fraction) {
+        int held = 0;
+        for (int c = 0; c < info->unisonCopies; c++) {
+            struct edgeInfo * edge = &info->edges[c];
+            u32 phase = copyPhase(info, c);
+            u32 increment = copyIncrement(info, c);
+            u32 readPhase = phase;
+            if (edge->syncIncrement)
+                readPhase = (u32)(((u64)phase * edge->syncIncrement) / (increment ? increment : 1));
+            // the sample about to be read is the last one, so it can't be an edge
+            edge->syncPhase = readPhase - edge->syncIncrement;
+            edge->lastReadPhase = readPhase;
+            held += transitionSample<Algorithm>(frame, readPhase >> PHASE_SHIFT, fraction);
+        }
+        // and the first sample is played twice rather than after a gap
+        info->blepPending = held;
+        info->bandLimited = true;
+    }
+
+    u32 copyPhase(struct wableInfo * info, int copy) {
+        return copy ? info->unisonPhases[copy - 1] : info->phase;
+    }
+
+    u32 copyIncrement(struct wableInfo * info, int copy) {
+        return copy ? info->unisonIncrements[copy - 1] : info->phaseIncrement;
+    }
+
+    /**
+     * NOTE TO FUTURE PROGRAMMERS - Band limiting
+     *
+     * A wave that jumps from one value to another between two samples has harmonics all
+     * the way up, and at 10 kHz most of them fold back down as aliasing. The swipe splices
+     * wave 1 and wave 2 together with a jump at the split and another at the wrap, and
+     * hard sync jumps every time it restarts the synced oscillator.
+     *
+     * Instead of filtering everything, the jumps are found as they happen, and the two
+     * samples either side of each one are bent by the polyBLEP residual in blepTable.
+     * Since a jump is only noticed on the sample after it, every band limited voice plays
+     * one sample late so the sample before the jump can still be changed.
+     *
+     * Unison copies are band limited and synced the same way, each against its own
+     * phase. All their bends go into the one held back sample, since that's their sum.
+     */
+    template <int Algorithm>
+    int bandLimitedSample(struct wableInfo * info, int copy, u32 phase, u32 increment, const frame_t *frame, int fraction) {
+        struct edgeInfo * state = &info->edges[copy];
+        u32 readPhase = phase;
+        u32 lastReadPhase = state->lastReadPhase;
+        u32 readBlepScale = state->blepScale;
+        int edge = 0; // how far the wave jumped since the last sample
+        u32 sinceEdge = 0; // and how long ago, as a phase
+        u32 blepScale = 0; // for turning sinceEdge into a blepTable index
+
+        if (state->syncIncrement) {
+            u32 continued = state->syncPhase + state->syncIncrement;
+            readPhase = continued;
+            if (phase < increment) {
+                // the copy's phase just wrapped, so restart the synced one from wherever
+                // it would have got to since then. the jump is from where the synced
+                // phase was when that happened back to the start of the wave
+                readPhase = (u32)(((u64)phase * state->syncIncrement) / increment);
+                edge = transitionSample<Algorithm>(frame, 0, fraction)
+                    - transitionSample<Algorithm>(frame, (continued - readPhase) >> PHASE_SHIFT, fraction);
+                sinceEdge = phase;
+                blepScale = state->blepScale;
+            }
+            state->syncPhase = readPhase;
+            readBlepScale = state->syncBlepScale;
+        }
+
+        int index = readPhase >> PHASE_SHIFT;
+        int output = transitionSample<Algorithm>(frame, index, fraction);
+
+        int split = ((PLAYBACK_LENGTH - 1) * fraction) >> 16;
+        if ((Algorithm == ALGORITHM_SWIPE || Algorithm == ALGORITHM_COMBO) && edge == 0 && split < PLAYBACK_LENGTH - 1) {
+            // up to the split the swipe plays wave 2, after it wave 1
+            u32 splitPhase = (u32)(split + 1) << PHASE_SHIFT;
+            bool wrapped = readPhase < lastReadPhase;
+            bool crossedSplit = wrapped
+                ? (splitPhase <= readPhase || splitPhase > lastReadPhase)
+                : (lastReadPhase < splitPhase && splitPhase <= readPhase);
+            if (wrapped && !crossedSplit) {
+                edge = _playback2[0] - _playback1[0];
+                sinceEdge = readPhase;
+            } else if (crossedSplit && !wrapped) {
+                edge = _playback1[split + 1] - _playback2[split + 1];
+                sinceEdge = readPhase - splitPhase;
+            }
+            blepScale = readBlepScale;
+            if (Algorithm == ALGORITHM_COMBO)
+                edge = (edge * ((1 << 16) - fraction)) >> 16;
+        }
+        state->lastReadPhase = readPhase;
+
+        if (edge) {
+            int x = ((u64)sinceEdge * blepScale) >> 32;
+            if (x > BLEP_LENGTH - 1)
+                x = BLEP_LENGTH - 1;
+            // the edge was x / BLEP_LENGTH of a sample before this one
+            info->blepPending += (edge * blepTable.values[x]) >> 16;
+            output -= (edge * (x ? blepTable.values[BLEP_LENGTH - x] : 32767)) >> 16;
+        }
+        return output;
+    }
+
+    /**
+     * the band limited path's version of a sample of every copy of the voice. it comes out
+     * one sample late, with the edges found in this one bent into it
+     */
+    template <int Algorithm>
+    int bandLimitedSample(struct wableInfo * info, u32 phase, const frame_t *frame, int fraction, bool unison) {
+        int output = bandLimitedSample<Algorithm>(info, 0, phase, info->phaseIncrement, frame, fraction);
+        if (unison) {
+            u32 *phases = info->unisonPhases;
+            const u32 *increments = info->unisonIncrements;
+            int extraCopies = info->unisonCopies - 1;
+            for (int c = 0; c < extraCopies; c++) {
+                output += bandLimitedSample<Algorithm>(info, c + 1, phases[c], increments[c], frame, fraction);
+                phases[c] += increments[c];
+            }
+        }
+        int delayed = info->blepPending;
+        info->blepPending = output;
+        return unison ? (delayed * info->unisonScale) >> 16 : delayed;
+    }
+
+    /**
+     * sets up the unison copies of a voice when its note starts. the copies are spread
+     * evenly around the cycle so they don't all start out in phase, and are detuned in
+     * pairs, one up and one down, with the outermost pair detuned the most.
+     *
+     * exports stay at one copy, since detuned copies never line up at the loop points
+     */
+    void startUnison(struct wableInfo * info) {
+        int copies = wavExport.exporting ? 1 : _unisonVoices + 1;
+        if (copies < 1)
+            copies = 1;
+        if (copies > UNISON_MAX)
+            copies = UNISON_MAX;
+        info->unisonCopies = copies;
+        info->unisonScale = (1 << 16) / copies;
+
+        int pairs = copies / 2;
+        for (int c = 1; c < copies; c++) {
+            int cents = _unisonDetune * ((c + 1) / 2) / (pairs ? pairs : 1);
+            if (c % 2 == 0)
+                cents = -cents;
+            // 2^(cents/1200) is close enough to 1 + cents*ln(2)/1200 this close to the note
+            int ratio = (1 << 16) + (cents * 3786) / 100;
+            info->unisonIncrements[c - 1] = ((u64)info->phaseIncrement * ratio) >> 16;
+            info->unisonPhases[c - 1] = ((u64)c << 32) / copies;
+        }
+    }
+
+    /**
+     * adds the extra unison copies to a sample of a voice. all the copies share the
+     * frame and transition fraction worked out for the voice, and only their phases differ
+     */
+    template <int Algorithm>
+    int unisonSample(struct wableInfo * info, const frame_t *frame, int fraction, int sample) {
+        u32 *phases = info->unisonPhases;
+        const u32 *increments = info->unisonIncrements;
+        int extraCopies = info->unisonCopies - 1;
+        for (int c = 0; c < extraCopies; c++) {
+            sample += transitionSample<Algorithm>(frame, phases[c] >> PHASE_SHIFT, fraction);
+            phases[c] += increments[c];
+        }
+        return (sample * info->unisonScale) >> 16;
+    }
+
+    /**
+     * advances the phase of the voice by one sample
+     *
+     * @return the index into the playback tables
+     */
+    template <int Cycle, bool Exporting>
+    int getWavePhase(struct wableInfo * info) {
+        u32 phase = info->phase;
+        info->phase += info->phaseIncrement;
+
+        // the phase wraps around by itself. only exports need to know when it does
+        if (Exporting && info->phase < phase && ++info->cyclesElapsed == EXPORT_LOOP_CYCLES) {
+            // restart the phase exactly so the loop points line up
+            info->cyclesElapsed = 0;
+            info->phase = 0;
             if (wavExport.exporting) {
                 // if the transition cycle is in forward mode and the export frames elapsed is greater than the max transition time,
                 // then we need to start setting up loop points and end the exporting process
-                if (_transitionCycle == 0 && wavExport.exportFramesElapsed > _transitionTime) {
+                if (Cycle == CYCLE_FORWARD && wavExport.exportFramesElapsed > _transitionTime) {
                     if (wavExport.loopStart == -1) {
                         wavExport.loopStart = wavExport.exportFramesElapsed;
                     } else {
@@ -1537,7 +4246,7 @@ private:
                 }
             }
         }
-        return phase % TABLE_LENGTH;
+        return phase >> PHASE_SHIFT;
     }
 
     int getTransitionIndex(struct SoundInfo * sound) {
@@ -1545,117 +4254,533 @@ private:
         return Lerp::lerp(0, TABLE_LENGTH - 1, info->transitionFramesElapsed, _transitionTime);
     }
 
-    void incrementFrameCount(struct SoundInfo * sound) {
+    template <int Cycle, bool Exporting>
+    void incrementFrameCount(struct wableInfo * info) {
+        if (Cycle == CYCLE_FORWARD) {
+            info->transitionFramesElapsed++;
+        } else if (Cycle == CYCLE_LOOP) {
+            info->transitionFramesElapsed = (info->transitionFramesElapsed + 1) % _transitionTime;
+            if (Exporting && wavExport.exporting && wavExport.exportFramesElapsed >= _transitionTime) {
+                wavExport.loopStart = 0;
+                wavExport.loopEnd = wavExport.exportFramesElapsed - 1;
+                wavExport.exporting = false;
+            }
+        } else if (Cycle == CYCLE_PING_PONG) {
+            if (info->pingPongDirection == true) {
+                if (info->transitionFramesElapsed++ >= _transitionTime)
+                    info->pingPongDirection = false;
+            } else {
+                if (info->transitionFramesElapsed-- <= 0) {
+                    info->pingPongDirection = true;
+                    if (Exporting && wavExport.exporting) {
+                        wavExport.loopStart = 0;
+                        wavExport.loopEnd = wavExport.exportFramesElapsed - 1;
+                        wavExport.exporting = false;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * works out where in the transition the voice will be at the end of this control
+     * period, LFO included, and sets up the ramp to get there
+     *
+     * @param noteStart jump straight to the target instead of ramping to it
+     */
+    void controlTick(struct SoundInfo * sound, bool noteStart) {
         struct wableInfo * info = &infos[sound->key];
-        sound->phaseFramesElapsed++;
-        switch (_transitionCycle) {
-            case 0:
-                info->transitionFramesElapsed++;
+        updateSync(info);
+
+        if (_modMatrix.lfoRate() != _lfoRate) {
+            _lfoRate = _modMatrix.lfoRate();
+            _lfoIncrement = Lfo::increment(_lfoRate, controlRate());
+        }
+
+        int sources[ModMatrix::NUM_SOURCES];
+        sources[ModMatrix::SOURCE_LFO] = info->lfo.tick(_lfoIncrement);
+        sources[ModMatrix::SOURCE_ENVELOPE] = 0;
+
+        int target = (_transition[getTransitionIndex(sound)] << 16) / (TABLE_MAX - 1);
+        target += _modMatrix.modulation(ModMatrix::DEST_WAVE_POSITION, sources) << (16 - MOD_SHIFT);
+        if (target < 0)
+            target = 0;
+        if (target > 1 << 16)
+            target = 1 << 16;
+
+        if (noteStart) {
+            info->transitionFraction = target;
+            info->transitionStep = 0;
+        } else {
+            info->transitionFraction = info->transitionTarget;
+            info->transitionStep = (target - info->transitionTarget) >> CONTROL_SHIFT;
+        }
+        info->transitionTarget = target;
+        info->frame = _frames[(target * (WAVETABLE_FRAMES - 1) + (1 << 15)) >> 16];
+        info->controlFramesLeft = CONTROL_PERIOD;
+
+        // once the fraction stops moving, every cycle from here on is the same one, so
+        // ask the main loop to render it once and play it back from the cycle cache
+        // (the swipe's edges are band limited as they're played, so it can't be cached)
+        bool steady = !noteStart && !wavExport.exporting && !usesFrameStore()
+            && _algorithm != ALGORITHM_SWIPE && _algorithm != ALGORITHM_COMBO
+            && target == info->transitionFraction;
+        if (!steady) {
+            info->cacheState = CACHE_NONE;
+        } else if (info->cacheState == CACHE_NONE || info->cacheFraction != target) {
+            info->cacheState = CACHE_WANTED;
+            info->cacheFraction = target;
+        } else if (info->cacheState == CACHE_READY) {
+            info->frame = _cycleCaches[sound->key];
+        }
+    }
+
+    /**
+     * renders the cycles voices asked for in controlTick. this runs in the main loop,
+     * so the audio never waits on it, and voices keep rendering the slow way until
+     * their cycle is ready
+     */
+    void buildCycleCaches() {
+        for (int i = 0; i < 13; i++) {
+            struct wableInfo * info = &infos[i];
+            if (info->cacheState != CACHE_WANTED)
+                continue;
+            fillCycle(_cycleCaches[i], info->cacheFraction);
+            info->frame = _cycleCaches[i];
+            info->cacheState = CACHE_READY;
+        }
+    }
+
+    /**
+     * fills one frame of the frame store with the selected algorithm
+     */
+    void buildFrame(int frame) {
+        fillCycle(_frames[frame], (frame << 16) / (WAVETABLE_FRAMES - 1));
+    }
+
+    /**
+     * renders a whole cycle of the selected algorithm at one transition fraction
+     */
+    void fillCycle(frame_t *dest, int fraction) {
+        switch (_algorithm) {
+            case ALGORITHM_SPECTRAL:
+                spectralCycle(dest, fraction);
                 break;
-            case 1:
-                info->transitionFramesElapsed = (info->transitionFramesElapsed + 1) % _transitionTime;
-                if (wavExport.exporting && wavExport.exportFramesElapsed >= _transitionTime) {
-                    wavExport.loopStart = 0;
-                    wavExport.loopEnd = wavExport.exportFramesElapsed - 1;
-                    wavExport.exporting = false;
-                }
+            case ALGORITHM_SWIPE:
+                for (int i = 0; i < PLAYBACK_LENGTH; i++)
+                    dest[i] = transitionSample<ALGORITHM_SWIPE>(NULL, i, fraction);
                 break;
-            case 2: {
-                if (info->pingPongDirection == true) {
-                    if (info->transitionFramesElapsed++ >= _transitionTime)
-                        info->pingPongDirection = false;
-                } else {
-                    if (info->transitionFramesElapsed-- <= 0) {
-                        info->pingPongDirection = true;
-                        if (wavExport.exporting) {
-                            wavExport.loopStart = 0;
-                            wavExport.loopEnd = wavExport.exportFramesElapsed - 1;
-                            wavExport.exporting = false;
-                        }
-                    }
-                }
+            case ALGORITHM_COMBO:
+                for (int i = 0; i < PLAYBACK_LENGTH; i++)
+                    dest[i] = transitionSample<ALGORITHM_COMBO>(NULL, i, fraction);
                 break;
+            default:
+                for (int i = 0; i < PLAYBACK_LENGTH; i++)
+                    dest[i] = transitionSample<ALGORITHM_MORPH>(NULL, i, fraction);
+        }
+    }
+
+    /**
+     * works out the magnitude and phase of every harmonic of both waves
+     */
+    void analyzeSpectra() {
+        analyzeSpectrum(_playback1, _magnitudes1, _phases1);
+        analyzeSpectrum(_playback2, _magnitudes2, _phases2);
+        _spectraReady = true;
+    }
+
+    /**
+     * the FFT only has SPECTRAL_LENGTH points, and taking every so many'th playback sample
+     * would fold a drawn wave's sharp edges back down into harmonics the wave doesn't
+     * have. so the playback table is split into one comb of samples per offset, each comb
+     * is FFT'd, and the combs are lined back up with a twiddle each. that's the first
+     * SPECTRAL_LENGTH / 2 harmonics of the whole table exactly, with everything above
+     * them left out instead of aliased
+     */
+    void analyzeSpectrum(const u8 (&playback)[PLAYBACK_LENGTH], int *magnitudes, int *phases) {
+        const int combs = PLAYBACK_LENGTH / SPECTRAL_LENGTH;
+        int sumRe[SPECTRAL_LENGTH / 2 + 1] = {};
+        int sumIm[SPECTRAL_LENGTH / 2 + 1] = {};
+        int re[SPECTRAL_LENGTH];
+        int im[SPECTRAL_LENGTH];
+        for (int offset = 0; offset < combs; offset++) {
+            for (int i = 0; i < SPECTRAL_LENGTH; i++) {
+                re[i] = playback[i * combs + offset] << SPECTRAL_SHIFT;
+                im[i] = 0;
+            }
+            Fft::transform(re, im, SPECTRAL_BITS, false);
+            for (int k = 0; k <= SPECTRAL_LENGTH / 2; k++) {
+                // the comb starts offset samples in, which turns harmonic k back by this much
+                u32 turn = -(u32)(offset * k) << (32 - PLAYBACK_BITS);
+                int wr = sineTable.lookup(turn + (1u << 30));
+                int wi = sineTable.lookup(turn);
+                sumRe[k] += (int)(((s64)re[k] * wr - (s64)im[k] * wi) >> 15) / combs;
+                sumIm[k] += (int)(((s64)re[k] * wi + (s64)im[k] * wr) >> 15) / combs;
             }
-            
         }
+        for (int k = 0; k <= SPECTRAL_LENGTH / 2; k++)
+            Fft::toPolar(sumRe[k], sumIm[k], magnitudes[k], phases[k]);
     }
 
-    s16 getOutputSample(struct SoundInfo * sound) {
+    /**
+     * the spectral morph. each harmonic's magnitude fades from wave 1's to wave 2's, and
+     * its phase turns the short way round from one to the other, so the in between
+     * frames keep the harmonics of both instead of cancelling them out like a crossfade
+     */
+    void spectralCycle(frame_t *dest, int fraction) {
+        if (!_spectraReady)
+            analyzeSpectra();
+
+        int re[SPECTRAL_LENGTH];
+        int im[SPECTRAL_LENGTH];
+        for (int k = 0; k <= SPECTRAL_LENGTH / 2; k++) {
+            int magnitude = _magnitudes1[k] + (int)(((s64)(_magnitudes2[k] - _magnitudes1[k]) * fraction) >> 16);
+            int turn = (s16)(_phases2[k] - _phases1[k]); // -half a circle to half a circle
+            int phase = _phases1[k] + ((turn * fraction) >> 16);
+            Fft::fromPolar(magnitude, phase, re[k], im[k]);
+        }
+        // a real wave's spectrum is mirrored around the middle
+        for (int k = 1; k < SPECTRAL_LENGTH / 2; k++) {
+            re[SPECTRAL_LENGTH - k] = re[k];
+            im[SPECTRAL_LENGTH - k] = -im[k];
+        }
+        im[0] = 0;
+        im[SPECTRAL_LENGTH / 2] = 0;
+        Fft::transform(re, im, SPECTRAL_BITS, true);
+
+        // stretch the cycle back out to PLAYBACK_LENGTH, rounding as we go. a morph can ring
+        // past either wave, so clip it to what a drawn wave could be
+        const int stretch = PLAYBACK_BITS - SPECTRAL_BITS;
+        for (int i = 0; i < PLAYBACK_LENGTH; i++) {
+            int j = i >> stretch;
+            int a = re[j];
+            int b = re[(j + 1) & (SPECTRAL_LENGTH - 1)];
+            int sample = a + (((b - a) * (i & ((1 << stretch) - 1))) >> stretch);
+            sample = (sample + (1 << (SPECTRAL_SHIFT - 1))) >> SPECTRAL_SHIFT;
+            if (sample < 0)
+                sample = 0;
+            if (sample > TABLE_MAX - 1)
+                sample = TABLE_MAX - 1;
+            dest[i] = sample;
+        }
+    }
+
+    /**
+     * @param frame the frame to play, only used by KERNEL_FRAMES
+     * @param fraction how far from wave 1 to wave 2 we are, out of 1 << 16
+     */
+    template <int Algorithm>
+    int transitionSample(const frame_t *frame, int phase, int fraction) {
+        if (Algorithm == KERNEL_FRAMES)
+            return frame[phase];
+
+        int sample1 = _playback1[phase];
+        int sample2 = _playback2[phase];
+        int morph = sample1 + (((sample2 - sample1) * fraction) >> 16);
+        if (Algorithm == ALGORITHM_MORPH)
+            return morph;
+
+        int split = ((PLAYBACK_LENGTH - 1) * fraction) >> 16;
+        int swipe = (phase > split) ? sample1 : sample2;
+        if (Algorithm == ALGORITHM_SWIPE)
+            return swipe;
+
+        // using a combination of both algorithms
+        return swipe + (((morph - swipe) * fraction) >> 16);
+    }
+
+    /**
+     * the audio rate part of the synth. everything slow was already worked out by controlTick
+     *
+     * @param frames must not go past the next control tick
+     */
+    template <int Algorithm, int Cycle, bool Exporting>
+    void renderFrames(struct SoundInfo * sound, struct wableInfo * info, int *mix, int frames) {
+        int fraction = info->transitionFraction;
+        int step = info->transitionStep;
+        const frame_t *frame = info->frame;
+        bool unison = !Exporting && info->unisonCopies > 1;
+        bool bandLimited = Algorithm == ALGORITHM_SWIPE || Algorithm == ALGORITHM_COMBO || info->edges[0].syncIncrement;
+        if (bandLimited && !info->bandLimited)
+            restartEdges<Algorithm>(info, frame, fraction);
+        info->bandLimited = bandLimited;
+
+        for (; frames; frames--) {
+            u32 fullPhase = info->phase;
+            int phase = getWavePhase<Cycle, Exporting>(info);
+            int output;
+            if (bandLimited) {
+                output = bandLimitedSample<Algorithm>(info, fullPhase, frame, fraction, unison);
+            } else {
+                output = transitionSample<Algorithm>(frame, phase, fraction);
+                if (unison)
+                    output = unisonSample<Algorithm>(info, frame, fraction, output);
+            }
+            fraction += step;
+            incrementFrameCount<Cycle, Exporting>(info);
+            *mix++ += output;
+            if (Exporting) {
+                // if the sound is exporting, increment export frame count
+                if (!wavExport.exporting)
+                    break;
+                wavExport.exportFramesElapsed++;
+            }
+        }
+
+        info->transitionFraction = fraction;
+    }
+
+    void renderSound(struct SoundInfo * sound, int *mix, int length) override {
+        renderSound(sound, mix, length, selectKernel());
+    }
+
+    void renderSound(struct SoundInfo * sound, int *mix, int length, Kernel kernel) {
         struct wableInfo * info = &infos[sound->key];
-        if (sound->playing) {
+        Kernel cachedKernel = selectKernel(KERNEL_FRAMES);
+        if (ampEnvelope.sounding(sound)) {
             if (sound->justPressed) {
                 if (wavExport.exporting) {
                     wavExport.exportFramesElapsed = 0;
                     wavExport.loopStart = -1;
                     wavExport.loopEnd = -1;
                 }
+                info->phase = 0;
+                info->phaseIncrement = ((u64)sound->freq << 32) / _samplingRate;
+                info->cyclesElapsed = 0;
                 info->pingPongDirection = true;
                 info->transitionFramesElapsed = 0;
+                info->lfo.reset();
+                startUnison(info);
+                startBandLimiting(info);
+                controlTick(sound, true);
                 sound->justPressed = false;
             }
-            int phase = getWavePhase(sound);
-            s16 sample1 = _wave1Array[phase];
-            s16 sample2 = _wave2Array[phase];
-            
-            int transitionValue = _transition[getTransitionIndex(sound)];
-
-            int output;
-            switch (_algorithm) {
-                case 0: { // Morph algorithm
-                    output = Lerp::lerp(sample1, sample2, transitionValue, TABLE_MAX - 1);
-                    break;
-                }
-                case 1: { // Swipe algorithm
-                    int split = Lerp::lerp(0, TABLE_LENGTH - 1, transitionValue, TABLE_MAX - 1);
-                    if (phase > split)
-                        output = sample1;
-                    else
-                        output = sample2;
-                    break;
-                }
-                case 2: { // using a combination of both algorithms
-                    int morph = Lerp::lerp(sample1, sample2, transitionValue, TABLE_MAX - 1);
-                    int swipe;
-                    int split = Lerp::lerp(0, TABLE_LENGTH - 1, transitionValue, TABLE_MAX - 1);
-                    if (phase > split)
-                        swipe = sample1;
-                    else
-                        swipe = sample2;
-                    output = Lerp::lerp(swipe, morph, transitionValue, TABLE_MAX - 1);
-                    break;
-                }
-                default: // if the default is reached, something went wrong
-                    output = 0;
+            while (length > 0) {
+                if (info->controlFramesLeft == 0)
+                    controlTick(sound, false);
+                int frames = length < info->controlFramesLeft ? length : info->controlFramesLeft;
+                if (info->cacheState == CACHE_READY)
+                    (this->*cachedKernel)(sound, info, mix, frames);
+                else
+                    (this->*kernel)(sound, info, mix, frames);
+                info->controlFramesLeft -= frames;
+                mix += frames;
+                length -= frames;
             }
+        }
+    }
 
-            // if the note just started, depop by lerping to initial output
-            if (sound->depopFramesElapsed < DEPOP_FRAMES) {
-                output = Lerp::lerp(0, output, sound->depopFramesElapsed++, DEPOP_FRAMES);
-            } else {
-                incrementFrameCount(sound);
-            }
-            
-            sound->lastSampleOutputted = _gain * output;
+    s16 getOutputSample(struct SoundInfo * sound) {
+        int output = 0;
+        renderSound(sound, &output, 1);
+        return _gain * output;
+    }
 
-            // if the sound is exporting, increment export frame count
-            if (wavExport.exporting)
-                wavExport.exportFramesElapsed++;
+};
 
-            return _gain * output;
-        } else {
-            int output;
-            if (sound->stopping) {
-                output = Lerp::lerp(0, sound->lastSampleOutputted, sound->depopFramesElapsed--, DEPOP_FRAMES);
-                if (sound->depopFramesElapsed <= 0)
-                    sound->stopping = false;
-            } else {
-                output = 0;
+#define WAVETABLE_KERNELS(algorithm) { \
+    { &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_FORWARD, false>, &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_FORWARD, true> }, \
+    { &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_LOOP, false>, &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_LOOP, true> }, \
+    { &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_PING_PONG, false>, &Wavetable::renderFrames<algorithm, Wavetable::CYCLE_PING_PONG, true> } }
+
+const Wavetable::Kernel Wavetable::kernels[Wavetable::NUM_KERNEL_ROWS][Wavetable::NUM_CYCLES][2] = {
+    WAVETABLE_KERNELS(Wavetable::ALGORITHM_MORPH),
+    WAVETABLE_KERNELS(Wavetable::ALGORITHM_SWIPE),
+    WAVETABLE_KERNELS(Wavetable::ALGORITHM_COMBO),
+    WAVETABLE_KERNELS(Wavetable::KERNEL_FRAMES), // the spectral morph only ever plays from the frame store
+    WAVETABLE_KERNELS(Wavetable::KERNEL_FRAMES)
+};
+
+static_assert(Wavetable::overlayBytes() <= OVERLAY_SIZE, "Wavetable doesn't fit in the overlay");
+static_assert(PluckedString::overlayBytes() <= OVERLAY_SIZE, "PluckedString doesn't fit in the overlay");
+static_assert(Novelty::overlayBytes() <= OVERLAY_SIZE, "Novelty doesn't fit in the overlay");
+static_assert(FM::overlayBytes() <= OVERLAY_SIZE, "FM doesn't fit in the overlay");
+
+/**
+ * NOTE TO FUTURE PROGRAMMERS - The Benchmark
+ *
+ * Pressing Y holds down all 13 keys of the current synth and renders BENCHMARK_BLOCKS
+ * blocks as fast as the DS can. It prints how many ARM9 cycles each output sample took
+ * and how much of the CPU the synth would need at its sampling rate. Anything close to
+ * 100% is going to pop. Run it before and after an optimization to see if it helped.
+ * Above that is the synth's memory: what it keeps for itself, what it took from the
+ * overlay, and how much of that each voice takes.
+ *
+ * Synths that oversample get a line like "1x12/-14 2x25/-24 4x50/-24" below: at each
+ * rate, the cycles per operator, then how many dB below the note's harmonics everything
+ * else is when the synth plays its test patch. That's the aliasing the extra cycles buy
+ * off.
+ */
+class Benchmark {
+public:
+    static void run(Synth *synth) {
+        struct SoundInfo saved[13];
+        memcpy(saved, sounds, sizeof(sounds));
+        for (int i = 0; i < 13; i++) {
+            sounds[i].playing = true;
+            sounds[i].justPressed = true;
+            sounds[i].stopping = false;
+            sounds[i].freq = 220 + 20 * i;
+            sounds[i].phaseFramesElapsed = 0;
+        }
+
+        synth->finishBackgroundWork();
+
+        u32 ticks = measure(synth);
+
+        // play it again without unison, so the cost of the extra copies can be told apart
+        int copies = synth->getUnisonCopies();
+        u32 singleTicks = ticks;
+        if (copies > 1) {
+            synth->setUnisonCopies(1);
+            singleTicks = measure(synth);
+            synth->setUnisonCopies(copies);
+        }
+
+        // and at every oversampling rate, to weigh what the filtering costs against what
+        // it takes out
+        int oversampling = synth->getOversampling();
+        u32 oversampledTicks[FM_MAX_OVERSAMPLING + 1];
+        int aliasing[FM_MAX_OVERSAMPLING + 1];
+        if (oversampling >= 0) {
+            for (int i = 0; i <= FM_MAX_OVERSAMPLING; i++) {
+                synth->setOversampling(i);
+                oversampledTicks[i] = measure(synth);
+                aliasing[i] = measureAliasing(synth);
             }
+            synth->setOversampling(oversampling);
+        }
 
-            return output;
+        // the voices were taken over by the benchmark, so restart anything that's held
+        memcpy(sounds, saved, sizeof(sounds));
+        for (int i = 0; i < 13; i++)
+            sounds[i].justPressed = sounds[i].playing;
+
+        int samples = BENCHMARK_BLOCKS * MIX_BLOCK;
+        int cyclesPerSample = (2 * ticks) / samples; // the ARM9 runs at twice the bus clock
+        int percent = ((u64)ticks * synth->getSamplingRate() * 100) / ((u64)samples * BUS_CLOCK);
+        text.moveTo(0, 20);
+        text.format("%dK own %dK overlay %dB/v %d%%      ", synth->residentBytes() / 1024, overlay.used() / 1024, synth->bytesPerVoice(), CallbackTimer::takeWorstPercent(synth->getSamplingRate()));
+        text.moveTo(0, 21);
+        text.format("%d cyc/sample (%d/voice) %d%%      ", cyclesPerSample, cyclesPerSample / 13, percent);
+        text.moveTo(0, 22);
+        if (copies > 1) {
+            // the two runs are timed separately, so noise can make the unison one come out faster
+            s64 extraTicks = (s64)ticks - (s64)singleTicks;
+            if (extraTicks < 0)
+                extraTicks = 0;
+            int cyclesPerCopy = (2 * extraTicks) / ((s64)samples * 13 * (copies - 1));
+            text.format("unison x%d: %d cyc/copy    ", copies, cyclesPerCopy);
+        } else if (oversampling >= 0) {
+            int operators = synth->getOperatorCount() > 0 ? synth->getOperatorCount() : 1;
+            text.clearRows(22, 1);
+            for (int i = 0; i <= FM_MAX_OVERSAMPLING; i++)
+                text.format("%dx%d/%d ", 1 << i, (2 * oversampledTicks[i]) / (samples * 13 * operators), aliasing[i]);
+        } else if (synth->getOperatorCount() > 0) {
+            int operators = synth->getOperatorCount();
+            text.format("%d ops: %d cyc/op              ", operators, cyclesPerSample / (13 * operators));
+        } else {
+            text.clearRows(22, 1);
+        }
+    }
+
+private:
+    /**
+     * plays the synth's test patch on one key, with the amplitude envelope wide open,
+     * and works out how much of what comes out isn't on the note's harmonic series. The
+     * note is pitched so its harmonics land exactly on FFT bins and everything that
+     * folds back down lands between them
+     *
+     * @return how far below the harmonics the rest is, in dB. 0 without a test patch
+     */
+    static int measureAliasing(Synth *synth) {
+        if (!synth->useTestPatch(true))
+            return 0;
+        struct SoundInfo saved[13];
+        memcpy(saved, sounds, sizeof(sounds));
+        int savedEnvelope[4];
+        memcpy(savedEnvelope, ampEnvelope.vals, sizeof(savedEnvelope));
+        ampEnvelope.vals[AMP_ATTACK] = 0;
+        ampEnvelope.vals[AMP_DECAY] = 0;
+        ampEnvelope.vals[AMP_SUSTAIN] = MOD_AMOUNT_MAX;
+        ampEnvelope.vals[AMP_RELEASE] = 0;
+        for (int i = 0; i < 13; i++) {
+            sounds[i].playing = i == 0;
+            sounds[i].justPressed = i == 0;
+            sounds[i].envelope.stage = AmpEnvelope::STAGE_OFF;
+            sounds[i].envelope.gate = false;
+        }
+        const int points = 1 << BENCHMARK_SPECTRUM_BITS;
+        sounds[0].freq = synth->getSamplingRate() * BENCHMARK_SPECTRUM_BIN / points;
+
+        s16 block[MIX_BLOCK];
+        for (int i = 0; i < BENCHMARK_SETTLE_BLOCKS; i++)
+            synth->renderBlock(block, MIX_BLOCK);
+        int re[points];
+        int im[points];
+        for (int i = 0; i < points; i += MIX_BLOCK) {
+            synth->renderBlock(block, MIX_BLOCK);
+            for (int j = 0; j < MIX_BLOCK; j++) {
+                re[i + j] = block[j] << 8; // the forward FFT divides by points, so keep the small bins
+                im[i + j] = 0;
+            }
         }
+        Fft::transform(re, im, BENCHMARK_SPECTRUM_BITS, false);
+
+        u64 harmonics = 0;
+        u64 rest = 0;
+        for (int k = 1; k <= points / 2; k++) {
+            u64 power = (s64)re[k] * re[k] + (s64)im[k] * im[k];
+            if (k % BENCHMARK_SPECTRUM_BIN == 0)
+                harmonics += power;
+            else
+                rest += power;
+        }
+
+        memcpy(ampEnvelope.vals, savedEnvelope, sizeof(savedEnvelope));
+        memcpy(sounds, saved, sizeof(sounds));
+        synth->useTestPatch(false);
+        return decibels(rest, harmonics);
+    }
+
+    /**
+     * 10 log10(power / reference), to about half a dB. log2 is the top bit's position plus
+     * the bits under it as a straight line, which is never more than 0.09 off
+     */
+    static int decibels(u64 power, u64 reference) {
+        if (reference == 0)
+            return 0;
+        if (power == 0)
+            return -99;
+        int difference = log2Q8(power) - log2Q8(reference);
+        // 10 log10(2) is 3.0103, 771 / 256 of one
+        return (difference * 771 + (difference < 0 ? -32768 : 32768)) / 65536;
+    }
+
+    /**
+     * @return log2 of value, out of 256
+     */
+    static int log2Q8(u64 value) {
+        int top = 63;
+        while (!(value >> top))
+            top--;
+        int fraction = top >= 8 ? (int)(value >> (top - 8)) & 255 : (int)(value << (8 - top)) & 255;
+        return (top << 8) + fraction;
     }
 
+    /**
+     * starts all 13 voices over and times BENCHMARK_BLOCKS blocks of them
+     */
+    static u32 measure(Synth *synth) {
+        for (int i = 0; i < 13; i++)
+            sounds[i].justPressed = true;
+        synth->prepareNotes(); // like the main loop would, so note ons aren't timed
+        s16 block[MIX_BLOCK];
+        u32 start = Clock::now();
+        for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+            synth->renderBlock(block, MIX_BLOCK);
+        return Clock::now() - start;
+    }
 };
 
 /**
@@ -1681,14 +4806,23 @@ public:
         sfzExportTutorial("If you use the Konami Code\n while in a synth mode that\n supports sfz exporting, then\n sfz exporting will begin.\n Consult the README for file\n setup.\n\nHeadphones are suggested as the\n DS's speakers can be rather\n quiet.\n\nUse the select button to cycle\n through synth modes and exit\n this tutorial. . ."),
         empth(1500, 20000),
         
+        modVals {0, 0, 0, 0},
+        modMatrix(modVals),
+        ampEnvelopeMultiSlider("Amplitude Envelope\n 1. Attack\n 2. Decay\n 3. Sustain\n 4. Release\n\nShapes the volume of every note\n in every synth. Times go up to\n about 4 seconds. Exported sfz\n files tell the sampler to play\n the same envelope.", ampEnvelope.vals, 4, TABLE_MAX),
+        modMatrixMultiSlider("Modulation\n 1. LFO Rate\n 2. LFO -> Wave Position\n 3. Envelope Decay\n 4. Envelope -> FM Amplitude\n\nThe LFO gently moves through\n the transition shape. The\n envelope makes FM modulators\n start bright and fade out.", modVals, 4, TABLE_MAX),
+
         wavetableEditorRing(),
         waveTableOne("Wavetable One\n\nA wavetable synthesizer works\n by taking one period of a wave\n and looping through it at\n various frequencies.\n\nUse the table editor below to\n draw one period of a wave.", wave1Array),
         waveTableTwo("Wavetable Two\n\nUse this editor to draw another\n wave.", wave2Array),
         morphShapeTable("Transition Shape\n\nThis table editor isn't used to\n draw a wave. Instead, it is\n used to define how wave 1 will\n transition to wave 2 over time.\n\nFully up means only the first\n wave will play. Fully down\n means only the second wave\n plays. Halfway means a wave\n halfway between both waves\n plays.", transition),
         morphTimeSlider("Transition Time\n Left:  0 seconds\n Right: 10 seconds\n\nThis slider determines how long\n it takes to go through the\n transition shape.", transitionTime, SAMPLING_RATE * 10),
-        algorithmSwitch("Transition Algorithm\n 1. Morph\n 2. Swipe\n 3. Combo\n\nWhat does halfway between two\n waves mean anyway?\n\nIn my opinion, I see two main\n ways of interpreting this:\n 1. morph: an average of both\n    waves\n 2. swipe: the first half of\n    wave 1 tacked onto the\n    second half of wave 2\n", algorithm, 3),
+        algorithmSwitch("Transition Algorithm\n 1. Morph\n 2. Swipe\n 3. Combo\n 4. Spectral\n\nWhat does halfway between two\n waves mean anyway?\n\nIn my opinion, I see two main\n ways of interpreting this:\n 1. morph: an average of both\n    waves\n 2. swipe: the first half of\n    wave 1 tacked onto the\n    second half of wave 2\nSpectral fades the harmonics of\n one wave into the other's.\n", algorithm, 4),
         transitionCycleSwitch("Transition Cycle Mode\n 1. Forward\n 2. Loop\n 3. Ping Pong\n\nIn forward mode, when the right\n of the transition shape is\n reached, it stays at the right\nIn loop mode, when the right is\n reached, it loops back to the\n left of the transition shape\nIn ping-pong mode, when the\n right is reached, it starts\n going backwards to the left,\n then back to the right, ad\n infinitum.", transitionCycle, 3),
-        wable(31, 10000, wave1Array, wave2Array, transition, transitionTime, algorithm, transitionCycle),
+        wavetableModeSwitch("Wavetable Mode\n 1. Two Waves\n 2. Frames\n\nTwo waves works out the\n transition between the waves\n for every sample.\n\nFrames works out 64 steps of\n the transition ahead of time\n and plays them back, which is\n much lighter on the CPU.", wavetableMode, 2),
+        unisonSwitch("Unison Voices\n 1 to 8\n\nHow many detuned copies of the\n wave each key plays. The\n copies are mixed down, so more\n of them sounds thicker rather\n than louder.", unisonVoices, UNISON_MAX),
+        unisonDetuneSlider("Unison Detune\n Left:  0 cents\n Right: 50 cents\n\nHow far apart the unison\n copies are tuned.", unisonDetune, UNISON_MAX_DETUNE),
+        syncRatioSlider("Hard Sync\n Left:  off\n Right: 8 times the key\n\nPlays the wave faster than the\n key, but starts it over every\n time the key's cycle starts\n over. Sweep it for that classic\n tearing sound.", syncRatio, SYNC_RATIO_MAX),
+        wable(31, 10000, wave1Array, wave2Array, transition, transitionTime, algorithm, transitionCycle, wavetableMode, unisonVoices, unisonDetune, syncRatio, modMatrix),
 
         pluckedEditorRing(),
         drumSlider("Blend Factor\n Left:   ???\n Middle: Drum\n Right:  Plucked String", blendFactor, TABLE_LENGTH),
@@ -1707,13 +4841,19 @@ public:
         novel(27, 20000, novAlg, novTab, novSlid1, novSwitch),
 
         fmEditorRing(),
-        fmAmpVals {TABLE_LENGTH - 1, 0, 0, 0},
-        fmAmpMultiSlider("Operator Amplitudes (Ops 1-4)", fmAmpVals, 4, TABLE_LENGTH),
-        fmRouting {4, 5, 5, 5},
-        fmRoutingMultiSwitch("Operator Routing", fmRouting, 4, 6),
-        fmRatios {1, 1, 1, 1},
-        fmRatioMultiSwitch("Operator Ratio", fmRatios, 4, 13),
-        fam(1, 8192, fmAmpVals, fmRouting, fmRatios)
+        fmAmpVals {TABLE_LENGTH - 1, 0, 0, 0, 0, 0, 0, 0},
+        fmAmpMultiSlider("Operator Amplitudes (Ops 1-8)", fmAmpVals, FM_OPERATORS, TABLE_LENGTH),
+        fmRouting {FM_ROUTE_OUTPUT, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF, FM_ROUTE_OFF},
+        fmRoutingMultiSwitch("Operator Routing\n Left to right: modulates op 1\n to 8, output, off", fmRouting, FM_OPERATORS, FM_ROUTE_OFF + 1),
+        fmRatios {1, 1, 1, 1, 1, 1, 1, 1},
+        fmRatioMultiSwitch("Operator Ratio", fmRatios, FM_OPERATORS, 13),
+        fmFeedbacks {0, 0, 0, 0, 0, 0, 0, 0},
+        fmFeedbackMultiSlider("Operator Feedback (Ops 1-8)\n\nFeeds each operator back into\n itself. A little makes it\n brighter, a lot makes noise.", fmFeedbacks, FM_OPERATORS, TABLE_MAX),
+        fmAlgorithm {0},
+        fmAlgorithmSwitch("FM Algorithm\n 1. Routing editor\n 2. One stack\n 3. Two stacks\n 4. Four pairs\n 5. Seven on one\n 6. Two trees\n 7. Organ\n\nThe presets take over from the\n routing editor.", fmAlgorithm, FM_PRESETS + 1),
+        fmOversampling {0},
+        fmOversamplingSwitch("FM Oversampling\n 1. Off\n 2. 2x\n 3. 4x\n\nLoud modulators make harmonics\n too high for the DS to play,\n which fold back down as harsh\n noise. Oversampling renders\n faster and filters them out,\n at 2 or 4 times the CPU.", fmOversampling, FM_MAX_OVERSAMPLING + 1),
+        fam(1, 16384, fmAmpVals, fmRouting, fmRatios, fmFeedbacks, fmAlgorithm, fmOversampling, modMatrix)
     {
 
         tutorialEditorRing.add(&sfzExportTutorial);
@@ -1721,6 +4861,12 @@ public:
         tutorialEditorRing.add(&tableTutorial);
         tutorialEditorRing.add(&welcome);
 
+        wavetableEditorRing.add(&ampEnvelopeMultiSlider);
+        wavetableEditorRing.add(&modMatrixMultiSlider);
+        wavetableEditorRing.add(&syncRatioSlider);
+        wavetableEditorRing.add(&unisonDetuneSlider);
+        wavetableEditorRing.add(&unisonSwitch);
+        wavetableEditorRing.add(&wavetableModeSwitch);
         wavetableEditorRing.add(&transitionCycleSwitch);
         wavetableEditorRing.add(&algorithmSwitch);
         wavetableEditorRing.add(&morphTimeSlider);
@@ -1728,17 +4874,24 @@ public:
         wavetableEditorRing.add(&waveTableTwo);
         wavetableEditorRing.add(&waveTableOne);
 
+        pluckedEditorRing.add(&ampEnvelopeMultiSlider);
         pluckedEditorRing.add(&burstTable);
         pluckedEditorRing.add(&burstTypeSwitch);
         pluckedEditorRing.add(&drumSlider);
 
+        noveltyEditorRing.add(&ampEnvelopeMultiSlider);
         noveltyEditorRing.add(&noveltySwitch);
         noveltyEditorRing.add(&noveltySlider1);
         noveltyEditorRing.add(&noveltyTable);
         noveltyEditorRing.add(&noveltyAlgorithmSwitch);
 
+        fmEditorRing.add(&ampEnvelopeMultiSlider);
+        fmEditorRing.add(&modMatrixMultiSlider);
+        fmEditorRing.add(&fmOversamplingSwitch);
+        fmEditorRing.add(&fmFeedbackMultiSlider);
         fmEditorRing.add(&fmRatioMultiSwitch);
         fmEditorRing.add(&fmRoutingMultiSwitch);
+        fmEditorRing.add(&fmAlgorithmSwitch);
         fmEditorRing.add(&fmAmpMultiSlider);
 
         synEdPairRing.add(new SynEdPair("FM\n\n", &fmEditorRing, &fam));
@@ -1750,20 +4903,10 @@ public:
     }
 
     void initScreen() {
-        // initialize the screen
-        for (int i = 0; i < 256; i++) {
-            for (int j = 0; j < 192; j++) {
-                if (i < SCREEN_PADDING ||
-                    i > SCREEN_WIDTH - SCREEN_PADDING ||
-                    j < SCREEN_PADDING ||
-                    j > SCREEN_HEIGHT - SCREEN_PADDING)
-                    VRAM_A[256 * j + i] = RGB15(15, 15, 15);
-                else if (j == SCREEN_PADDING)
-                    VRAM_A[256 * j + i] = RGB15(31, 31, 31); 
-                else
-                    VRAM_A[256 * j + i] = RGB15(0, 0, 0);
-            }
-        }
+        // initialize the screen: a grey border around the editor, with a white line on top
+        Surface::fillRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, RGB15(15, 15, 15));
+        Surface::fillRect(SCREEN_PADDING, SCREEN_PADDING, TABLE_LENGTH, TABLE_MAX, RGB15(0, 0, 0));
+        Surface::fillRect(SCREEN_PADDING, SCREEN_PADDING, TABLE_LENGTH, 1, RGB15(31, 31, 31));
         synEdPairRing.curr()->onEditorSwitch();
     }
 
@@ -1773,24 +4916,32 @@ public:
     void ExecuteOneMainLoop() {
         handleButtons();
         synEdPairRing.curr()->getEditorRing()->curr()->handleTouch();
+        if (patchRevision != lastPatchRevision) {
+            lastPatchRevision = patchRevision;
+            synEdPairRing.curr()->getSynth()->onPatchChange();
+        }
+        synEdPairRing.curr()->getSynth()->doBackgroundWork();
         piano.resamplePianoKeys();
+        synEdPairRing.curr()->getSynth()->prepareNotes();
     }
 
     /**
-     * this handles each loop in the audio stream
+     * this handles each block of the audio stream
      * 
-     * it returns the sample to output
+     * it fills dest with the next length samples. length must be no more than MIX_BLOCK
      */
-    s16 ExecuteOneStreamLoop() {
+    void ExecuteOneStreamBlock(s16 *dest, int length) {
         if (synEdPairRing.curr()->getSynth()->isExporting()) {
-            return 0;
+            for (int i = 0; i < length; i++)
+                dest[i] = 0;
         } else {
-            return synEdPairRing.curr()->getSynth()->frameOutput();
+            synEdPairRing.curr()->getSynth()->renderBlock(dest, length);
         }
     }
 
 private:
     Piano piano;
+    int lastPatchRevision = -1;
 
     class SynEdPair {
     public:
@@ -1800,13 +4951,23 @@ private:
             synth{synth_} {}
         
         void onSynthSwitch() {
+            overlay.reset();
+            synth->attach(overlay);
+            synth->onPatchChange();
             synth->mmChangeSettings();
+            // the new synth's voices start out blank, so held keys start over and keys
+            // that were fading out are cut off
+            for (int i = 0; i < 13; i++) {
+                sounds[i].justPressed = sounds[i].playing;
+                if (!sounds[i].playing)
+                    sounds[i].envelope.stage = AmpEnvelope::STAGE_OFF;
+            }
         }
 
         void onEditorSwitch() {
-            consoleClear();
-            printf("Wavetable Synthesizer for\n the Nintendo DS\n\n");
-            printf("%s", description);
+            text.clear();
+            text.print("Wavetable Synthesizer for\n the Nintendo DS\n\n");
+            text.print(description);
             editorRing->curr()->draw();
         }
 
@@ -1834,6 +4995,11 @@ private:
     EmptyEditor sfzExportTutorial;
     EmptySynth empth;
 
+    int modVals[8];
+    ModMatrix modMatrix; // shared by every synth that has a control tick
+    MultiSlider ampEnvelopeMultiSlider;
+    MultiSlider modMatrixMultiSlider;
+
     LinkedRing<Editor *> wavetableEditorRing;
     s16 wave1Array[TABLE_LENGTH];
     Table waveTableOne;
@@ -1847,6 +5013,14 @@ private:
     Switch algorithmSwitch;
     int transitionCycle = 0; // 0. forward 1. loop 2. ping pong
     Switch transitionCycleSwitch;
+    int wavetableMode = 0; // 0. two waves 1. frames
+    Switch wavetableModeSwitch;
+    int unisonVoices = 0; // 0 is one copy, 7 is eight
+    int unisonDetune = 0;
+    Switch unisonSwitch;
+    Slider unisonDetuneSlider;
+    int syncRatio = 0;
+    Slider syncRatioSlider;
     Wavetable wable;
 
     LinkedRing<Editor *> pluckedEditorRing;
@@ -1876,6 +5050,12 @@ private:
     MultiSwitch fmRoutingMultiSwitch;
     int fmRatios[8];
     MultiSwitch fmRatioMultiSwitch;
+    int fmFeedbacks[8];
+    MultiSlider fmFeedbackMultiSlider;
+    int fmAlgorithm;
+    Switch fmAlgorithmSwitch;
+    int fmOversampling;
+    Switch fmOversamplingSwitch;
     FM fam;
 
     KonamiCodeDetector komani;
@@ -1911,6 +5091,8 @@ private:
 			piano.decPitch();
         if (keysD & KEY_X)
             piano.playTestTone();
+        if (keysD & KEY_Y)
+            Benchmark::run(synEdPairRing.curr()->getSynth());
         int keysU = keysUp();
         if (keysU & KEY_X)
             piano.stopTestTone();
@@ -1928,11 +5110,17 @@ mm_word on_stream_request( mm_word length, mm_addr dest, mm_stream_formats forma
 //----------------------------------------------------------------------------------
 
 	s16 *target = (s16*)dest;
+	u32 start = Clock::now();
 
 	int len = length;
-	for( ; len; len-- ) {
-		*target++ = app.ExecuteOneStreamLoop();
+	while( len ) {
+		int block = len < MIX_BLOCK ? len : MIX_BLOCK;
+		app.ExecuteOneStreamBlock( target, block );
+		scope.write( target, block );
+		target += block;
+		len -= block;
 	}
+	CallbackTimer::record(Clock::now() - start, length);
 	
 	return length;
 }
@@ -1940,12 +5128,14 @@ mm_word on_stream_request( mm_word length, mm_addr dest, mm_stream_formats forma
 
 int main( void ) {
 	pc = consoleDemoInit();
+	scope.init();
+    Clock::init();
 	
     
     if (fatInitDefault())
-	    printf("LibFat succesful init\n");
+	    text.print("LibFat succesful init\n");
 	else
-	    printf("LibFat ini'nt succesful\n");
+	    text.print("LibFat ini'nt succesful\n");
     //NF_SetRootFolder("sfz");
 
 	videoSetMode(MODE_FB0);
@@ -1993,6 +5183,11 @@ int main( void ) {
 
 		// wait until next frame
 		swiWaitForVBlank();
+
+		// put what the editors drew last loop on the screen while it isn't being drawn
+		Surface::present();
+		text.present();
+		scope.draw();
 		
         app.ExecuteOneMainLoop();
 		